@@ -10,23 +10,134 @@
 #include <avcpp/format.h>
 #include <avcpp/formatcontext.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <system_error>
+#include <thread>
+#include <unistd.h>
 
 #include "../common/error.hpp"
 #include "audio.hpp"
 
 namespace audio {
 
-std::unique_ptr<FileSink> openSink(const std::string path, SinkOpts opts,
-                                   std::error_code &err) noexcept {
-  auto sink = std::make_unique<FileSink>();
-  auto &formatContext = sink->formatContext;
-  auto &aencContext = sink->aencContext;
-  auto &streamIndex = sink->streamIndex;
-  auto &outputFormat = sink->outputFormat;
-  outputFormat = av::guessOutputFormat(path, path);
-  formatContext.setFormat(outputFormat);
-  av::Codec codec = av::findEncodingCodec(outputFormat, false);
+int MemoryInput::read(uint8_t *buf, size_t size) {
+  size = std::min(size, data.size() - position);
+  if (!size) {
+    return AVERROR_EOF;
+  }
+  std::memcpy(buf, data.data() + position, size);
+  position += size;
+  return size;
+}
+
+int64_t MemoryInput::seek(int64_t offset, int whence) {
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return data.size() - base;
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += position;
+    break;
+  case SEEK_END:
+    offset += data.size() - base;
+    break;
+  default:
+    return -1;
+  }
+  if (offset < 0 || offset > static_cast<int64_t>(data.size())) {
+    return -1;
+  }
+  position = offset;
+  return position;
+}
+
+int MemoryInput::seekable() const { return AVIO_SEEKABLE_NORMAL; }
+
+int MemoryOutput::write(const uint8_t *buf, size_t size) {
+  if (data.size() < base + position + size) {
+    data.resize(base + position + size);
+  }
+  std::memcpy(data.data() + base + position, buf, size);
+  position += size;
+  return size;
+}
+
+int64_t MemoryOutput::seek(int64_t offset, int whence) {
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return data.size() - base;
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += position;
+    break;
+  case SEEK_END:
+    offset += data.size() - base;
+    break;
+  default:
+    return -1;
+  }
+  if (offset < 0) {
+    return -1;
+  }
+  position = offset;
+  return position;
+}
+
+int MemoryOutput::seekable() const { return AVIO_SEEKABLE_NORMAL; }
+
+int PipeIO::read(uint8_t *buf, size_t size) {
+  while (true) {
+    auto n = ::read(fd, buf, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return AVERROR(errno);
+    }
+    return n ? n : AVERROR_EOF;
+  }
+}
+
+int PipeIO::write(const uint8_t *buf, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    auto n = ::write(fd, buf + written, size - written);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return AVERROR(errno);
+    }
+    written += n;
+  }
+  return written;
+}
+
+FileIO::~FileIO() { ::close(fd); }
+
+int64_t FileIO::seek(int64_t offset, int whence) {
+  if ((whence & ~AVSEEK_FORCE) == AVSEEK_SIZE) {
+    struct stat st;
+    return fstat(fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+  }
+  auto position = ::lseek(fd, offset, whence & ~AVSEEK_FORCE);
+  return position < 0 ? AVERROR(errno) : position;
+}
+
+int FileIO::seekable() const { return AVIO_SEEKABLE_NORMAL; }
+
+// Sets up the encoder and the output stream of a sink whose format context
+// has its format set.
+static bool openEncoder(FileSink &sink, SinkOpts opts,
+                        std::error_code &err) noexcept {
+  auto &formatContext = sink.formatContext;
+  auto &aencContext = sink.aencContext;
+  av::Codec codec = av::findEncodingCodec(sink.outputFormat, false);
   aencContext = av::AudioEncoderContext(codec);
 
   aencContext.setSampleRate(opts.sampleRate);
@@ -36,9 +147,22 @@ std::unique_ptr<FileSink> openSink(const std::string path, SinkOpts opts,
   aencContext.open(err);
   if (err) {
     std::cerr << "Failed to open encoder" << std::endl;
-    return nullptr;
+    return false;
   }
   av::Stream ost = formatContext.addStream(aencContext);
+  return true;
+}
+
+std::unique_ptr<FileSink> openSink(const std::string path, SinkOpts opts,
+                                   std::error_code &err) noexcept {
+  auto sink = std::make_unique<FileSink>();
+  auto &formatContext = sink->formatContext;
+  auto &outputFormat = sink->outputFormat;
+  outputFormat = av::guessOutputFormat(path, path);
+  formatContext.setFormat(outputFormat);
+  if (!openEncoder(*sink, opts, err)) {
+    return nullptr;
+  }
   formatContext.openOutput(path, err);
   if (err) {
     std::cerr << "Failed to open file as sink" << std::endl;
@@ -49,6 +173,83 @@ std::unique_ptr<FileSink> openSink(const std::string path, SinkOpts opts,
   return sink;
 }
 
+std::unique_ptr<FileSink> openSink(std::unique_ptr<av::CustomIO> io,
+                                   const std::string format, SinkOpts opts,
+                                   std::error_code &err) noexcept {
+  auto sink = std::make_unique<FileSink>();
+  auto &formatContext = sink->formatContext;
+  auto &outputFormat = sink->outputFormat;
+  sink->io = std::move(io);
+  outputFormat = av::guessOutputFormat(format);
+  if (outputFormat.isNull()) {
+    std::cerr << "Unknown output format: " << format << std::endl;
+    err = std::make_error_code(std::errc::invalid_argument);
+    return nullptr;
+  }
+  formatContext.setFormat(outputFormat);
+  if (!openEncoder(*sink, opts, err)) {
+    return nullptr;
+  }
+  formatContext.openOutput(sink->io.get(), err);
+  if (err) {
+    std::cerr << "Failed to open " << sink->io->name() << " as sink"
+              << std::endl;
+    return nullptr;
+  }
+  formatContext.writeHeader();
+  return sink;
+}
+
+std::unique_ptr<FileSink> openSink(std::vector<uint8_t> &data,
+                                   const std::string format, SinkOpts opts,
+                                   std::error_code &err) noexcept {
+  return openSink(std::make_unique<MemoryOutput>(data), format, opts, err);
+}
+
+std::unique_ptr<FileSink> openResumedSink(const std::string path, SinkOpts opts,
+                                          int64_t offset,
+                                          std::error_code &err) noexcept {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    err = std::error_code(errno, std::generic_category());
+    return nullptr;
+  }
+  // drop whatever was written after the offset
+  if (ftruncate(fd, offset) < 0) {
+    err = std::error_code(errno, std::generic_category());
+    ::close(fd);
+    return nullptr;
+  }
+
+  auto sink = std::make_unique<FileSink>();
+  auto &formatContext = sink->formatContext;
+  auto &outputFormat = sink->outputFormat;
+  sink->io = std::make_unique<FileIO>(fd);
+  outputFormat = av::guessOutputFormat(path, path);
+  formatContext.setFormat(outputFormat);
+  if (!openEncoder(*sink, opts, err)) {
+    return nullptr;
+  }
+  formatContext.openOutput(sink->io.get(), err);
+  if (err) {
+    std::cerr << "Failed to open file as sink" << std::endl;
+    return nullptr;
+  }
+  formatContext.writeHeader();
+  if (offset > 0 && avio_seek(formatContext.raw()->pb, offset, SEEK_SET) < 0) {
+    std::cerr << "Failed to seek to the end of the resumed output" << std::endl;
+    err = std::make_error_code(std::errc::invalid_seek);
+    return nullptr;
+  }
+  return sink;
+}
+
+std::unique_ptr<FileSink> openStdoutSink(const std::string format,
+                                         SinkOpts opts,
+                                         std::error_code &err) noexcept {
+  return openSink(std::make_unique<PipeIO>(STDOUT_FILENO), format, opts, err);
+}
+
 void FileSink::write(const av::AudioSamples &samples, PipeState state,
                      std::error_code &err) noexcept {
   if (!state.hasFrames || state.isClosed) {
@@ -65,25 +266,55 @@ void FileSink::write(const av::AudioSamples &samples, PipeState state,
   formatContext.writePacket(pkt, err);
 }
 
+int64_t FileSink::flush(std::error_code &err) noexcept {
+  formatContext.flush();
+  auto pb = formatContext.raw()->pb;
+  avio_flush(pb);
+  if (pb->error < 0) {
+    err = std::error_code(AVUNERROR(pb->error), std::generic_category());
+    return -1;
+  }
+  if (auto file = dynamic_cast<FileIO *>(io.get()); file && fsync(file->fd)) {
+    err = std::error_code(errno, std::generic_category());
+    return -1;
+  }
+  return avio_tell(pb);
+}
+
 FileSink::~FileSink() noexcept {
   formatContext.flush();
   formatContext.writeTrailer();
 }
 
-std::unique_ptr<FileSource> openSource(const std::string path,
-                                       std::error_code &err) noexcept {
-  auto source = std::make_unique<FileSource>();
-  auto &formatContext = source->formatContext;
-  auto &adecContext = source->adecContext;
-  auto &streamIndex = source->streamIndex;
-  auto &stream = source->stream;
+// Sets up the decoder of an audio stream.
+static bool openStreamDecoder(av::Stream &stream,
+                              av::AudioDecoderContext &adecContext,
+                              std::error_code &err) noexcept {
+  if (!stream.isValid()) {
+    std::cerr << "Invalid audio stream" << std::endl;
+    err = std::make_error_code(error::Code::Undefined);
+    return false;
+  }
 
-  formatContext.openInput(path, err);
+  adecContext = av::AudioDecoderContext(stream);
+  auto codec = av::findDecodingCodec(adecContext.raw()->codec_id);
+  adecContext.setCodec(codec);
+  adecContext.setRefCountedFrames(true);
+  adecContext.open(av::Codec(), err);
   if (err) {
-    std::cerr << "Failed to open file as source" << std::endl;
-    return nullptr;
+    std::cerr << "Failed to open codec" << std::endl;
+    return false;
   }
 
+  return true;
+}
+
+// Finds the first audio stream of an opened source and sets up its decoder.
+static bool openDecoder(FileSource &source, std::error_code &err) noexcept {
+  auto &formatContext = source.formatContext;
+  auto &streamIndex = source.streamIndex;
+  auto &stream = source.stream;
+
   formatContext.findStreamInfo();
 
   for (size_t i = 0; i < formatContext.streamsCount(); ++i) {
@@ -98,28 +329,57 @@ std::unique_ptr<FileSource> openSource(const std::string path,
   if (stream.isNull()) {
     std::cerr << "No audio stream found" << std::endl;
     err = std::make_error_code(error::Code::Undefined);
+    return false;
+  }
+
+  return openStreamDecoder(stream, source.adecContext, err);
+}
+
+std::unique_ptr<FileSource> openSource(const std::string path,
+                                       std::error_code &err) noexcept {
+  auto source = std::make_unique<FileSource>();
+
+  source->formatContext.openInput(path, err);
+  if (err) {
+    std::cerr << "Failed to open file as source" << std::endl;
     return nullptr;
   }
 
-  if (!stream.isValid()) {
-    std::cerr << "Invalid audio stream" << std::endl;
-    err = std::make_error_code(error::Code::Undefined);
+  if (!openDecoder(*source, err)) {
     return nullptr;
   }
 
-  adecContext = av::AudioDecoderContext(stream);
-  auto codec = av::findDecodingCodec(adecContext.raw()->codec_id);
-  adecContext.setCodec(codec);
-  adecContext.setRefCountedFrames(true);
-  adecContext.open(av::Codec(), err);
+  return source;
+}
+
+std::unique_ptr<FileSource> openSource(std::unique_ptr<av::CustomIO> io,
+                                       std::error_code &err) noexcept {
+  auto source = std::make_unique<FileSource>();
+  source->io = std::move(io);
+
+  source->formatContext.openInput(source->io.get(), err);
   if (err) {
-    std::cerr << "Failed to open codec" << std::endl;
+    std::cerr << "Failed to open " << source->io->name() << " as source"
+              << std::endl;
+    return nullptr;
+  }
+
+  if (!openDecoder(*source, err)) {
     return nullptr;
   }
 
   return source;
 }
 
+std::unique_ptr<FileSource> openSource(std::span<const uint8_t> data,
+                                       std::error_code &err) noexcept {
+  return openSource(std::make_unique<MemoryInput>(data), err);
+}
+
+std::unique_ptr<FileSource> openStdinSource(std::error_code &err) noexcept {
+  return openSource(std::make_unique<PipeIO>(STDIN_FILENO), err);
+}
+
 PipeState FileSource::read(av::AudioSamples &samples,
                            std::error_code &err) noexcept {
   while (true) {
@@ -133,6 +393,163 @@ PipeState FileSource::read(av::AudioSamples &samples,
   }
 }
 
+void FileSource::seek(int64_t frame, std::error_code &err) noexcept {
+  auto st = stream.raw();
+  auto timestamp =
+      av_rescale_q(frame, {1, adecContext.sampleRate()}, st->time_base);
+  if (st->start_time != AV_NOPTS_VALUE) {
+    timestamp += st->start_time;
+  }
+  if (avformat_seek_file(formatContext.raw(), streamIndex, INT64_MIN,
+                         timestamp, timestamp, 0) < 0) {
+    std::cerr << "Failed to seek source" << std::endl;
+    err = std::make_error_code(std::errc::invalid_seek);
+    return;
+  }
+  avcodec_flush_buffers(adecContext.raw());
+}
+
+std::unique_ptr<MultiFileSource>
+openMultiSource(const std::string path, std::error_code &err) noexcept {
+  auto source = std::make_unique<MultiFileSource>();
+  auto &formatContext = source->formatContext;
+
+  formatContext.openInput(path, err);
+  if (err) {
+    std::cerr << "Failed to open file as source" << std::endl;
+    return nullptr;
+  }
+
+  formatContext.findStreamInfo();
+
+  source->trackIndices.assign(formatContext.streamsCount(), -1);
+  for (size_t i = 0; i < formatContext.streamsCount(); ++i) {
+    auto st = formatContext.stream(i);
+    if (!st.isAudio()) {
+      continue;
+    }
+    auto &track = source->tracks.emplace_back();
+    track.streamIndex = i;
+    track.stream = st;
+    if (!openStreamDecoder(track.stream, track.adecContext, err)) {
+      return nullptr;
+    }
+    source->trackIndices[i] = source->tracks.size() - 1;
+  }
+
+  if (source->tracks.empty()) {
+    std::cerr << "No audio stream found" << std::endl;
+    err = std::make_error_code(error::Code::Undefined);
+    return nullptr;
+  }
+
+  for (auto &track : source->tracks) {
+    track.decoder = std::thread(MultiFileSource::decode, std::ref(track));
+  }
+
+  return source;
+}
+
+MultiFileSource::~MultiFileSource() {
+  for (auto &track : tracks) {
+    {
+      std::lock_guard lock(track.mutex);
+      track.stopped = true;
+    }
+    track.changed.notify_all();
+  }
+  for (auto &track : tracks) {
+    if (track.decoder.joinable())
+      track.decoder.join();
+  }
+}
+
+PipeState MultiFileSource::read(size_t track, av::AudioSamples &samples,
+                                std::error_code &err) noexcept {
+  auto &t = tracks[track];
+  std::unique_lock lock(t.mutex);
+  while (t.frames.empty()) {
+    if (t.err) {
+      err = t.err;
+      return {};
+    }
+    if (_eof && t.packets.empty() && !t.decoding)
+      return {.isClosed = true};
+    if (!_eof && t.packets.size() < batchSize) {
+      // keep the decoder busy while waiting for its frames
+      lock.unlock();
+      demux(track, err);
+      if (err)
+        return {};
+      lock.lock();
+      continue;
+    }
+    t.changed.wait(lock);
+  }
+  samples = std::move(t.frames.front());
+  t.frames.pop_front();
+  return {.hasFrames = true};
+}
+
+void MultiFileSource::demux(size_t track, std::error_code &err) noexcept {
+  auto queued = [this, track] {
+    std::lock_guard lock(tracks[track].mutex);
+    return tracks[track].packets.size();
+  };
+  while (queued() < batchSize) {
+    av::Packet pkt = formatContext.readPacket(err);
+    if (err || !pkt) {
+      // like FileSource, treat read errors as the end of the stream
+      err.clear();
+      _eof = true;
+      for (auto &t : tracks)
+        t.changed.notify_all();
+      return;
+    }
+    // streams may be added to the container after findStreamInfo
+    if (static_cast<size_t>(pkt.streamIndex()) >= trackIndices.size())
+      continue;
+    auto index = trackIndices[pkt.streamIndex()];
+    if (index < 0)
+      continue;
+    auto &t = tracks[index];
+    {
+      std::lock_guard lock(t.mutex);
+      t.packets.push_back(std::move(pkt));
+    }
+    t.changed.notify_all();
+  }
+}
+
+// Decoder thread of a track: decodes packets as they are queued, until the
+// source is destroyed.
+void MultiFileSource::decode(Track &track) noexcept {
+  std::unique_lock lock(track.mutex);
+  while (true) {
+    track.changed.wait(lock, [&track] {
+      return track.stopped || (!track.packets.empty() && !track.err);
+    });
+    if (track.stopped)
+      return;
+
+    auto pkt = std::move(track.packets.front());
+    track.packets.pop_front();
+    track.decoding = true;
+    lock.unlock();
+
+    std::error_code err;
+    auto samples = track.adecContext.decode(pkt, err);
+
+    lock.lock();
+    track.decoding = false;
+    if (err)
+      track.err = err;
+    else if (samples)
+      track.frames.push_back(std::move(samples));
+    track.changed.notify_all();
+  }
+}
+
 void Resampler::write(const av::AudioSamples &samples, PipeState state,
                       std::error_code &err) noexcept {
   if (!state.hasFrames) {
@@ -147,6 +564,21 @@ PipeState Resampler::read(av::AudioSamples &samples,
   if (_outputClosed) {
     return {.isClosed = true};
   }
+  if (skip) {
+    av::AudioSamples dropped(resampler.dstSampleFormat(), skip,
+                             resampler.dstChannelLayout(),
+                             resampler.dstSampleRate());
+    auto skipped = resampler.pop(dropped, _inputClosed, err);
+    if (err) {
+      return {};
+    }
+    if (!skipped) {
+      // wait for enough frames, unless there will be none
+      _outputClosed = _inputClosed;
+      return {.isClosed = _outputClosed};
+    }
+    skip = 0;
+  }
   samples =
       av::AudioSamples(resampler.dstSampleFormat(), frameSize,
                        resampler.dstChannelLayout(), resampler.dstSampleRate());
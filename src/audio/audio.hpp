@@ -1,7 +1,15 @@
 #pragma once
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <avcpp/audioresampler.h>
 #include <avcpp/av.h>
@@ -19,24 +27,155 @@ struct PipeState {
   bool isClosed;
 };
 
+// Frames of every source of a separation, one entry per source.
+using Stems = std::vector<av::AudioSamples>;
+
+// In-memory input over a caller-provided buffer. The buffer must outlive the
+// source reading from it.
+struct MemoryInput : public av::CustomIO {
+  std::span<const uint8_t> data;
+  size_t position = 0;
+  MemoryInput(std::span<const uint8_t> data) : data(data) {}
+  int read(uint8_t *buf, size_t size) override;
+  int64_t seek(int64_t offset, int whence) override;
+  int seekable() const override;
+  const char *name() const override { return "memory"; }
+};
+
+// In-memory output appending to a caller-provided buffer. The stream starts
+// at the end of what the buffer holds, so positions and the size exclude the
+// bytes already in it. The buffer must outlive the sink writing to it.
+struct MemoryOutput : public av::CustomIO {
+  std::vector<uint8_t> &data;
+  // Offset of the stream in `data`.
+  size_t base;
+  // Position in the stream, relative to `base`.
+  size_t position = 0;
+  MemoryOutput(std::vector<uint8_t> &data) : data(data), base(data.size()) {}
+  int write(const uint8_t *buf, size_t size) override;
+  int64_t seek(int64_t offset, int whence) override;
+  int seekable() const override;
+  const char *name() const override { return "memory"; }
+};
+
+// Unseekable IO over a file descriptor, e.g. stdin or stdout of a pipeline.
+struct PipeIO : public av::CustomIO {
+  int fd;
+  PipeIO(int fd) : fd(fd) {}
+  int read(uint8_t *buf, size_t size) override;
+  int write(const uint8_t *buf, size_t size) override;
+  const char *name() const override { return "pipe"; }
+};
+
+// Seekable IO over a file descriptor, which it closes when destroyed.
+struct FileIO : public PipeIO {
+  FileIO(int fd) : PipeIO(fd) {}
+  ~FileIO();
+  int64_t seek(int64_t offset, int whence) override;
+  int seekable() const override;
+  const char *name() const override { return "file"; }
+};
+
 struct FileSource {
+  // Custom IO the format context reads through, if any. Declared first so
+  // that it outlives the format context.
+  std::unique_ptr<av::CustomIO> io;
   av::FormatContext formatContext;
   av::AudioDecoderContext adecContext;
   ssize_t streamIndex;
   av::Stream stream;
   PipeState read(av::AudioSamples &samples, std::error_code &ec) noexcept;
+  // Seeks to the last keyframe at or before `frame`, counted at the sample
+  // rate of the stream. The position decoding resumes from is given by the
+  // timestamp of the next frame read.
+  void seek(int64_t frame, std::error_code &err) noexcept;
 };
 
 std::unique_ptr<FileSource> openSource(const std::string path,
                                        std::error_code &err) noexcept;
 
+// Opens a source reading through custom IO. The container format is probed
+// from the data.
+std::unique_ptr<FileSource> openSource(std::unique_ptr<av::CustomIO> io,
+                                       std::error_code &err) noexcept;
+
+// Opens a source decoding the contents of a buffer.
+std::unique_ptr<FileSource> openSource(std::span<const uint8_t> data,
+                                       std::error_code &err) noexcept;
+
+// Opens a source decoding stdin.
+std::unique_ptr<FileSource> openStdinSource(std::error_code &err) noexcept;
+
+// Source decoding every audio stream of a container in a single demux pass,
+// e.g. the mixdown and the stem tracks of an NI Stem file. Each track is read
+// through its own TrackSource, so that tracks can feed separate chains.
+//
+// Every track has a decoder thread of its own that decodes packets as the
+// demuxer queues them, so the tracks decode in parallel while they are read.
+struct MultiFileSource {
+  struct Track {
+    ssize_t streamIndex;
+    av::Stream stream;
+    av::AudioDecoderContext adecContext;
+    // Guards the queues and the decoder state below, shared with the decoder
+    // thread.
+    std::mutex mutex;
+    std::condition_variable changed;
+    // Demuxed packets waiting to be decoded.
+    std::deque<av::Packet> packets;
+    // Decoded frames waiting to be read.
+    std::deque<av::AudioSamples> frames;
+    bool decoding = false;
+    bool stopped = false;
+    std::error_code err;
+    std::thread decoder;
+  };
+
+  av::FormatContext formatContext;
+  // A deque, as tracks can be neither copied nor moved.
+  std::deque<Track> tracks;
+  // Track of each stream of the container, or -1 if it is not decoded.
+  std::vector<ssize_t> trackIndices;
+  // Number of packets queued for the requested track by each demux pass.
+  size_t batchSize = 16;
+
+  PipeState read(size_t track, av::AudioSamples &samples,
+                 std::error_code &err) noexcept;
+  ~MultiFileSource();
+
+private:
+  friend std::unique_ptr<MultiFileSource>
+  openMultiSource(const std::string path, std::error_code &err) noexcept;
+
+  bool _eof = false;
+  void demux(size_t track, std::error_code &err) noexcept;
+  static void decode(Track &track) noexcept;
+};
+
+struct TrackSource {
+  MultiFileSource &source;
+  size_t track;
+  PipeState read(av::AudioSamples &samples, std::error_code &err) noexcept {
+    return source.read(track, samples, err);
+  }
+};
+
+std::unique_ptr<MultiFileSource> openMultiSource(const std::string path,
+                                                 std::error_code &err) noexcept;
+
 struct FileSink {
+  // Custom IO the format context writes through, if any. Declared first so
+  // that it outlives the format context.
+  std::unique_ptr<av::CustomIO> io;
   av::FormatContext formatContext;
   av::OutputFormat outputFormat;
   av::AudioEncoderContext aencContext;
   ssize_t streamIndex;
   void write(const av::AudioSamples &samples, PipeState state,
              std::error_code &ec) noexcept;
+  // Writes out everything muxed so far and returns the size of the output in
+  // bytes.
+  int64_t flush(std::error_code &err) noexcept;
   ~FileSink() noexcept;
 };
 
@@ -49,6 +188,32 @@ struct SinkOpts {
 std::unique_ptr<FileSink> openSink(const std::string path, SinkOpts opts,
                                    std::error_code &err) noexcept;
 
+// Opens a sink writing through custom IO. As there is no file name to guess
+// from, the container format must be given by name, e.g. "wav".
+std::unique_ptr<FileSink> openSink(std::unique_ptr<av::CustomIO> io,
+                                   const std::string format, SinkOpts opts,
+                                   std::error_code &err) noexcept;
+
+// Opens a sink appending the encoded container to a buffer. The buffer is
+// complete once the sink is destroyed.
+std::unique_ptr<FileSink> openSink(std::vector<uint8_t> &data,
+                                   const std::string format, SinkOpts opts,
+                                   std::error_code &err) noexcept;
+
+// Opens a sink on a file that an interrupted run wrote `offset` bytes of, see
+// FileSink::flush, and continues writing at that offset; 0 starts a new file.
+// The container header is written again in place, so this only works for
+// formats whose header does not depend on the samples, e.g. "wav".
+std::unique_ptr<FileSink> openResumedSink(const std::string path, SinkOpts opts,
+                                          int64_t offset,
+                                          std::error_code &err) noexcept;
+
+// Opens a sink writing to stdout. Muxers that rewrite their header on close
+// cannot do so on a pipe, so prefer streamable formats.
+std::unique_ptr<FileSink> openStdoutSink(const std::string format,
+                                         SinkOpts opts,
+                                         std::error_code &err) noexcept;
+
 struct Resampler {
   template <class _C1, class _C2>
   Resampler(_C1 &&src, _C2 &&dst, std::error_code &err) noexcept
@@ -61,12 +226,17 @@ struct Resampler {
   PipeState read(av::AudioSamples &samples, std::error_code &err) noexcept;
   av::AudioResampler resampler;
   size_t frameSize;
-  bool _inputClosed;
-  bool _outputClosed;
+  // Number of output frames to drop before the next frame is read, e.g. to
+  // line up with a position reached by seeking the source.
+  size_t skip = 0;
+  bool _inputClosed = false;
+  bool _outputClosed = false;
 };
 
+// Chained source. A chained source passed as a temporary is held by value,
+// anything else by reference.
 template <class _Source, class _Trans> struct SourceChain {
-  _Source &source;
+  _Source source;
   _Trans &transformer;
 
   PipeState read(av::AudioSamples &samples, std::error_code &err) {
@@ -92,12 +262,12 @@ template <class _Source, class _Trans> struct SourceChain {
 template <class _Source, class _Trans>
 SourceChain<_Source, _Trans> operator>>(_Source &&source,
                                         _Trans &&transformer) noexcept {
-  return {source, transformer};
+  return {std::forward<_Source>(source), transformer};
 }
 
 template <class _Source, class _Sink>
 void run(_Source &source, _Sink &sink, std::error_code &err) noexcept {
-  PipeState state;
+  PipeState state{};
   av::AudioSamples samples(nullptr);
   while (!state.isClosed) {
     state = source.read(samples, err);
@@ -113,6 +283,39 @@ void run(_Source &source, _Sink &sink, std::error_code &err) noexcept {
   }
 }
 
+// Runs chains that share an upstream source, e.g. the tracks of a
+// MultiFileSource, stepping them in turn so that no chain runs ahead and
+// leaves the others' frames buffered.
+//
+// `sinks` holds pointers, the i-th sink consuming the i-th source.
+template <class _Sources, class _Sinks>
+void runEach(_Sources &sources, _Sinks &sinks, std::error_code &err) noexcept {
+  std::vector<PipeState> states(sources.size(), PipeState{});
+  av::AudioSamples samples(nullptr);
+  size_t open = sources.size();
+  while (open) {
+    for (size_t i = 0; i < sources.size(); ++i) {
+      auto &state = states[i];
+      if (state.isClosed)
+        continue;
+
+      state = sources[i].read(samples, err);
+      if (err)
+        return;
+
+      if (!state.hasFrames && !state.isClosed)
+        continue;
+
+      sinks[i]->write(samples, state, err);
+      if (err)
+        return;
+
+      if (state.isClosed)
+        --open;
+    }
+  }
+}
+
 void init();
 
 } // namespace audio
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <system_error>
+#include <utility>
+
+#include "audio.hpp"
+
+// Coroutine based pipeline stages.
+//
+// Sources are generators that `co_yield` frames and transforms are coroutines
+// that `co_await` their input stream. A stream is resumed only when its
+// consumer awaits it, and yielding transfers control straight back to the
+// consumer, so no stage is ever woken up without a frame to work on or a
+// consumer waiting for one. A stage ends its stream with `co_return`, which
+// also signals the end of input downstream; errors are reported through the
+// error code the stage was created with.
+namespace audio::coro {
+
+template <class T> class Stream {
+public:
+  struct promise_type;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  // Hands control back to whoever awaited the stream.
+  struct Transfer {
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(handle_type handle) noexcept {
+      return handle.promise().consumer;
+    }
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type {
+    std::optional<T> value;
+    std::coroutine_handle<> consumer = std::noop_coroutine();
+    std::exception_ptr exception;
+
+    Stream get_return_object() {
+      return Stream(handle_type::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    Transfer final_suspend() noexcept { return {}; }
+    Transfer yield_value(T v) {
+      value = std::move(v);
+      return {};
+    }
+    void return_void() { value.reset(); }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  struct Awaiter {
+    handle_type handle;
+    bool await_ready() noexcept { return handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) {
+      handle.promise().consumer = consumer;
+      handle.promise().value.reset();
+      return handle;
+    }
+    std::optional<T> await_resume() { return take(handle); }
+  };
+
+  Stream() = default;
+  explicit Stream(handle_type handle) : _handle(handle) {}
+  Stream(Stream &&other) noexcept
+      : _handle(std::exchange(other._handle, nullptr)) {}
+  Stream &operator=(Stream &&other) noexcept {
+    if (this != &other) {
+      if (_handle)
+        _handle.destroy();
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+  Stream(const Stream &) = delete;
+  Stream &operator=(const Stream &) = delete;
+  ~Stream() {
+    if (_handle)
+      _handle.destroy();
+  }
+
+  // Awaits the next value from a coroutine; empty once the stream ended.
+  Awaiter operator co_await() & noexcept { return {_handle}; }
+
+  // Pulls the next value from outside a coroutine; empty once the stream
+  // ended.
+  std::optional<T> next() {
+    if (!_handle || _handle.done())
+      return std::nullopt;
+    _handle.promise().consumer = std::noop_coroutine();
+    _handle.promise().value.reset();
+    _handle.resume();
+    return take(_handle);
+  }
+
+private:
+  handle_type _handle;
+
+  static std::optional<T> take(handle_type handle) {
+    auto &promise = handle.promise();
+    if (promise.exception)
+      std::rethrow_exception(std::exchange(promise.exception, nullptr));
+    return std::exchange(promise.value, std::nullopt);
+  }
+};
+
+using Frames = Stream<av::AudioSamples>;
+
+// Yields the frames of a read-style source, e.g. a FileSource.
+template <class _Source> Frames frames(_Source &source, std::error_code &err) {
+  while (true) {
+    av::AudioSamples samples(nullptr);
+    auto state = source.read(samples, err);
+    if (err || state.isClosed)
+      co_return;
+    if (state.hasFrames)
+      co_yield std::move(samples);
+  }
+}
+
+// Runs the values of a stream through a write/read-style transformer, e.g. a
+// Resampler or a Demucs. Everything the transformer has ready is read after
+// each write, as one input may yield several outputs, e.g. a resampler
+// cutting long frames to an encoder's frame size. Once the input ends, the
+// transformer is closed and drained. The transformer's output is read as
+// `_Out`, e.g. Stems to read every source of a Demucs.
+template <class _Out = av::AudioSamples, class _Trans, class _In>
+Stream<_Out> transform(Stream<_In> input, _Trans &transformer,
+                       std::error_code &err) {
+  PipeState state;
+  while (auto samples = co_await input) {
+    transformer.write(*samples, {.hasFrames = true}, err);
+    if (err)
+      co_return;
+
+    while (true) {
+      _Out out{};
+      state = transformer.read(out, err);
+      if (err || state.isClosed)
+        co_return;
+      if (!state.hasFrames)
+        break;
+      co_yield std::move(out);
+    }
+  }
+  if (err)
+    co_return;
+
+  _In none{};
+  transformer.write(none, {.isClosed = true}, err);
+  while (!err) {
+    _Out out{};
+    state = transformer.read(out, err);
+    if (err || !state.hasFrames)
+      co_return;
+    co_yield std::move(out);
+  }
+}
+
+template <class _Trans, class _Out> struct Stage {
+  _Trans &transformer;
+  std::error_code &err;
+};
+
+template <class _Out = av::AudioSamples, class _Trans>
+Stage<_Trans, _Out> stage(_Trans &transformer, std::error_code &err) noexcept {
+  return {transformer, err};
+}
+
+template <class _In, class _Trans, class _Out>
+Stream<_Out> operator>>(Stream<_In> input, Stage<_Trans, _Out> stage) {
+  return transform<_Out>(std::move(input), stage.transformer, stage.err);
+}
+
+// Yields the first stem of every value of a stream, e.g. the first source of
+// a Demucs read as Stems.
+inline Frames first(Stream<Stems> input) {
+  while (auto stems = co_await input) {
+    co_yield std::move(stems->front());
+  }
+}
+
+// Writes every value of a stream to a sink, then closes the sink.
+template <class T, class _Sink>
+void run(Stream<T> &stream, _Sink &sink, std::error_code &err) {
+  while (auto value = stream.next()) {
+    sink.write(*value, {.hasFrames = true}, err);
+    if (err)
+      return;
+  }
+  if (err)
+    return;
+  sink.write(T{}, {.isClosed = true}, err);
+}
+
+} // namespace audio::coro
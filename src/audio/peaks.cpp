@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define PEAKS_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PEAKS_NEON
+#endif
+
+#include "peaks.hpp"
+
+namespace audio {
+
+constexpr Peaks::Bin emptyBin = {
+    .min = std::numeric_limits<float>::infinity(),
+    .max = -std::numeric_limits<float>::infinity(),
+    .sumSquares = 0.,
+};
+
+// Folds `count` interleaved samples into the per-channel accumulators of a
+// bin. Vectorized when a register of four lanes holds whole frames, so that
+// every lane always sees the same channel.
+static void reduce(const float *data, size_t count, uint32_t channels,
+                   Peaks::Bin *bin) noexcept {
+  size_t i = 0;
+#if defined(PEAKS_SSE) || defined(PEAKS_NEON)
+  if (4 % channels == 0 && count >= 4) {
+    float lo[4], hi[4], sq[4];
+#ifdef PEAKS_SSE
+    __m128 vlo = _mm_loadu_ps(data);
+    __m128 vhi = vlo;
+    __m128 vsq = _mm_mul_ps(vlo, vlo);
+    for (i = 4; i + 4 <= count; i += 4) {
+      __m128 v = _mm_loadu_ps(data + i);
+      vlo = _mm_min_ps(vlo, v);
+      vhi = _mm_max_ps(vhi, v);
+      vsq = _mm_add_ps(vsq, _mm_mul_ps(v, v));
+    }
+    _mm_storeu_ps(lo, vlo);
+    _mm_storeu_ps(hi, vhi);
+    _mm_storeu_ps(sq, vsq);
+#else
+    float32x4_t vlo = vld1q_f32(data);
+    float32x4_t vhi = vlo;
+    float32x4_t vsq = vmulq_f32(vlo, vlo);
+    for (i = 4; i + 4 <= count; i += 4) {
+      float32x4_t v = vld1q_f32(data + i);
+      vlo = vminq_f32(vlo, v);
+      vhi = vmaxq_f32(vhi, v);
+      vsq = vmlaq_f32(vsq, v, v);
+    }
+    vst1q_f32(lo, vlo);
+    vst1q_f32(hi, vhi);
+    vst1q_f32(sq, vsq);
+#endif
+    for (size_t lane = 0; lane < 4; ++lane) {
+      auto &acc = bin[lane % channels];
+      acc.min = std::min(acc.min, lo[lane]);
+      acc.max = std::max(acc.max, hi[lane]);
+      acc.sumSquares += sq[lane];
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    auto &acc = bin[i % channels];
+    acc.min = std::min(acc.min, data[i]);
+    acc.max = std::max(acc.max, data[i]);
+    acc.sumSquares += data[i] * data[i];
+  }
+}
+
+void Peaks::write(const Stems &stems, PipeState state,
+                  std::error_code &err) noexcept {
+  if (state.hasFrames && !stems.empty()) {
+    if (stems.size() != paths.size()) {
+      std::cerr << "Peaks expects " << paths.size() << " stems" << std::endl;
+      err = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+    for (const auto &samples : stems) {
+      if (samples.sampleFormat() != AV_SAMPLE_FMT_FLT ||
+          samples.samplesCount() != stems[0].samplesCount() ||
+          samples.channelsCount() != stems[0].channelsCount()) {
+        std::cerr << "Peaks expects packed float samples of the same shape"
+                  << std::endl;
+        err = std::make_error_code(std::errc::invalid_argument);
+        return;
+      }
+    }
+    if (!channels) {
+      channels = stems[0].channelsCount();
+      sampleRate = stems[0].sampleRate();
+    }
+
+    size_t offset = 0;
+    size_t frames = stems[0].samplesCount();
+    while (frames) {
+      size_t n = std::min<size_t>(frames, opts.blockSize - _binFrames);
+      for (size_t i = 0; i < stems.size(); ++i) {
+        if (!_binFrames) {
+          bins[i].resize(bins[i].size() + channels, emptyBin);
+        }
+        auto data = reinterpret_cast<const float *>(stems[i].data());
+        reduce(data + offset * channels, n * channels, channels,
+               &bins[i][bins[i].size() - channels]);
+      }
+      offset += n;
+      frames -= n;
+      _binFrames = (_binFrames + n) % opts.blockSize;
+    }
+  }
+
+  if (state.isClosed && !_state.isClosed) {
+    save(err);
+  }
+
+  _stems = stems;
+  _state = state;
+}
+
+// Hands on the stems of the last write once.
+PipeState Peaks::read(Stems &stems, std::error_code &err) noexcept {
+  stems = std::exchange(_stems, {});
+  return std::exchange(_state.hasFrames, false) ? PipeState{.hasFrames = true}
+                                                : _state;
+}
+
+void Peaks::save(std::error_code &err) noexcept {
+  for (size_t i = 0; i < paths.size() && !err; ++i) {
+    save(paths[i], bins[i], err);
+  }
+}
+
+void Peaks::save(const std::string &path, const std::vector<Bin> &finest,
+                 std::error_code &err) noexcept {
+  // frames per bin of the current level; only the last bin may be partial
+  size_t binCount = channels ? finest.size() / channels : 0;
+  std::vector<uint64_t> frames(binCount, opts.blockSize);
+  if (binCount && _binFrames) {
+    frames.back() = _binFrames;
+  }
+
+  std::vector<std::vector<Bin>> levels;
+  std::vector<std::vector<uint64_t>> levelFrames;
+  if (binCount) {
+    levels.push_back(finest);
+    levelFrames.push_back(frames);
+  }
+  while (levels.size() && levels.size() < opts.levels &&
+         levelFrames.back().size() > 1) {
+    const auto &finer = levels.back();
+    const auto &finerFrames = levelFrames.back();
+    size_t count = (finerFrames.size() + opts.factor - 1) / opts.factor;
+    std::vector<Bin> coarser(count * channels, emptyBin);
+    std::vector<uint64_t> coarserFrames(count, 0);
+    for (size_t i = 0; i < finerFrames.size(); ++i) {
+      coarserFrames[i / opts.factor] += finerFrames[i];
+      for (size_t c = 0; c < channels; ++c) {
+        auto &acc = coarser[i / opts.factor * channels + c];
+        const auto &bin = finer[i * channels + c];
+        acc.min = std::min(acc.min, bin.min);
+        acc.max = std::max(acc.max, bin.max);
+        acc.sumSquares += bin.sumSquares;
+      }
+    }
+    levels.push_back(std::move(coarser));
+    levelFrames.push_back(std::move(coarserFrames));
+  }
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Failed to open peaks file " << path << std::endl;
+    err = std::make_error_code(std::errc::io_error);
+    return;
+  }
+
+  uint32_t header[] = {
+      1, sampleRate, channels, opts.blockSize, opts.factor,
+      static_cast<uint32_t>(levels.size()),
+  };
+  file.write("PEAK", 4);
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  for (const auto &level : levelFrames) {
+    uint64_t count = level.size();
+    file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+  }
+  for (size_t l = 0; l < levels.size(); ++l) {
+    for (size_t i = 0; i < levelFrames[l].size(); ++i) {
+      for (size_t c = 0; c < channels; ++c) {
+        const auto &bin = levels[l][i * channels + c];
+        float values[] = {bin.min, bin.max,
+                          std::sqrt(bin.sumSquares / levelFrames[l][i])};
+        file.write(reinterpret_cast<const char *>(values), sizeof(values));
+      }
+    }
+  }
+
+  if (!file) {
+    std::cerr << "Failed to write peaks file " << path << std::endl;
+    err = std::make_error_code(std::errc::io_error);
+  }
+}
+
+} // namespace audio
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "audio.hpp"
+
+namespace audio {
+
+struct PeaksOpts {
+  // Number of frames summarized by a bin of the finest level.
+  uint32_t blockSize;
+  // Number of bins of a level merged into one bin of the next level.
+  uint32_t factor;
+  // Maximum number of levels, finest first.
+  uint32_t levels;
+};
+
+constexpr PeaksOpts defaultPeaksOpts = {
+    .blockSize = 256, .factor = 4, .levels = 6};
+
+// Pass-through stage computing multi-resolution min/max/RMS peak data of
+// every stem of packed float samples, e.g. for drawing waveform overviews of
+// each separated source. The peaks file of each stem is written to its entry
+// of `paths` when the stream closes.
+//
+// File layout, native byte order:
+//   char[4] magic "PEAK", u32 version, u32 sampleRate, u32 channels,
+//   u32 blockSize, u32 factor, u32 levels, u64 binCount[levels],
+//   then for every level, bin and channel: f32 min, f32 max, f32 rms.
+struct Peaks {
+  struct Bin {
+    float min;
+    float max;
+    float sumSquares;
+  };
+
+  std::vector<std::string> paths;
+  PeaksOpts opts;
+
+  Peaks(const std::vector<std::string> &paths,
+        const PeaksOpts &opts = defaultPeaksOpts)
+      : paths(paths), opts(opts), bins(paths.size()){};
+  void write(const Stems &stems, PipeState state,
+             std::error_code &err) noexcept;
+  PipeState read(Stems &stems, std::error_code &err) noexcept;
+  void save(std::error_code &err) noexcept;
+
+  uint32_t sampleRate = 0;
+  uint32_t channels = 0;
+  // Bins of the finest level of every stem, `channels` entries per bin.
+  std::vector<std::vector<Bin>> bins;
+
+private:
+  void save(const std::string &path, const std::vector<Bin> &finest,
+            std::error_code &err) noexcept;
+
+  Stems _stems;
+  PipeState _state{};
+  // Frames accumulated into the last, partial bin.
+  uint32_t _binFrames = 0;
+};
+
+} // namespace audio
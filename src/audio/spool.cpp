@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spool.hpp"
+
+namespace audio {
+
+constexpr char spoolMagic[4] = {'S', 'T', 'S', 'P'};
+constexpr uint32_t spoolVersion = 1;
+constexpr size_t spoolAlignment = 64;
+// Frames allocated for every channel by the first write.
+constexpr uint64_t spoolInitialCapacity = 1 << 20;
+
+static std::error_code lastError() noexcept {
+  return std::error_code(errno, std::generic_category());
+}
+
+Spool::~Spool() {
+  if (_map) {
+    munmap(_map, _mapSize);
+  }
+}
+
+std::span<const float> Spool::samples(size_t source, size_t channel,
+                                      uint64_t begin,
+                                      uint64_t count) const noexcept {
+  if (source >= sources.size() || channel >= channels || begin >= frameCount) {
+    return {};
+  }
+  count = std::min(count, frameCount - begin);
+  auto region = _data + (source * channels + channel) * frameCount;
+  return {region + begin, static_cast<size_t>(count)};
+}
+
+size_t Spool::sourceIndex(const std::string &name) const noexcept {
+  return std::find(sources.begin(), sources.end(), name) - sources.begin();
+}
+
+std::unique_ptr<Spool> openSpool(const std::string &path,
+                                 std::error_code &err) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err = lastError();
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err = lastError();
+    ::close(fd);
+    return nullptr;
+  }
+
+  auto spool = std::make_unique<Spool>();
+  spool->_mapSize = st.st_size;
+  if (spool->_mapSize < sizeof(SpoolHeader)) {
+    ::close(fd);
+    err = std::make_error_code(std::errc::invalid_argument);
+    return nullptr;
+  }
+  auto map = mmap(nullptr, spool->_mapSize, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    err = lastError();
+    return nullptr;
+  }
+  spool->_map = map;
+
+  auto bytes = static_cast<const uint8_t *>(map);
+  SpoolHeader header;
+  std::memcpy(&header, bytes, sizeof(header));
+  uint64_t planes = uint64_t(header.sourceCount) * header.channels;
+  if (std::memcmp(header.magic, spoolMagic, sizeof(spoolMagic)) ||
+      header.version != spoolVersion ||
+      header.dataOffset % spoolAlignment != 0 ||
+      header.dataOffset > spool->_mapSize ||
+      (spool->_mapSize - header.dataOffset) / sizeof(float) <
+          planes * header.frameCount) {
+    err = std::make_error_code(std::errc::invalid_argument);
+    return nullptr;
+  }
+
+  size_t offset = sizeof(header);
+  for (uint32_t i = 0; i < header.sourceCount; ++i) {
+    uint32_t length;
+    if (offset + sizeof(length) > header.dataOffset) {
+      err = std::make_error_code(std::errc::invalid_argument);
+      return nullptr;
+    }
+    std::memcpy(&length, bytes + offset, sizeof(length));
+    offset += sizeof(length);
+    if (length > header.dataOffset - offset) {
+      err = std::make_error_code(std::errc::invalid_argument);
+      return nullptr;
+    }
+    spool->sources.emplace_back(reinterpret_cast<const char *>(bytes + offset),
+                                length);
+    offset += length;
+  }
+
+  spool->sampleRate = header.sampleRate;
+  spool->channels = header.channels;
+  spool->frameCount = header.frameCount;
+  spool->_data = reinterpret_cast<const float *>(bytes + header.dataOffset);
+  return spool;
+}
+
+std::unique_ptr<SpoolSink>
+openSpoolSink(const std::string &path, const std::vector<std::string> &sources,
+              std::error_code &err) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    err = lastError();
+    return nullptr;
+  }
+  return std::unique_ptr<SpoolSink>(new SpoolSink(path, sources, fd));
+}
+
+SpoolSink::SpoolSink(const std::string &path,
+                     const std::vector<std::string> &sources, int fd)
+    : path(path), sources(sources), _fd(fd) {
+  _dataOffset = sizeof(SpoolHeader);
+  for (const auto &source : sources) {
+    _dataOffset += sizeof(uint32_t) + source.size();
+  }
+  _dataOffset =
+      (_dataOffset + spoolAlignment - 1) / spoolAlignment * spoolAlignment;
+}
+
+SpoolSink::~SpoolSink() {
+  std::error_code err;
+  close(err);
+}
+
+// Grows the file so that every channel has room for `frames` frames, moving
+// the regions written so far to their new offsets.
+void SpoolSink::reserve(uint64_t frames, std::error_code &err) noexcept {
+  if (frames <= _capacity) {
+    return;
+  }
+  auto capacity = std::max({frames, 2 * _capacity, spoolInitialCapacity});
+  size_t planes = sources.size() * channels;
+  size_t oldSize = _dataOffset + _capacity * planes * sizeof(float);
+  size_t size = _dataOffset + capacity * planes * sizeof(float);
+
+  // allocate the blocks up front: writing to a hole of a sparse file through
+  // the mapping raises SIGBUS once the disk is full
+  if (int error = posix_fallocate(_fd, 0, size)) {
+    err = std::error_code(error, std::generic_category());
+    return;
+  }
+  if (_map) {
+    munmap(_map, oldSize);
+  }
+  auto map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED) {
+    _map = nullptr;
+    err = lastError();
+    return;
+  }
+  _map = static_cast<uint8_t *>(map);
+
+  // regions only move towards the end, so go last to first
+  auto data = reinterpret_cast<float *>(_map + _dataOffset);
+  for (size_t plane = planes; plane-- > 1;) {
+    std::memmove(data + plane * capacity, data + plane * _capacity,
+                 frameCount * sizeof(float));
+  }
+  _capacity = capacity;
+}
+
+void SpoolSink::write(const Stems &stems, PipeState state,
+                      std::error_code &err) noexcept {
+  if (state.hasFrames && _fd >= 0) {
+    if (stems.size() != sources.size()) {
+      err = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+    for (const auto &samples : stems) {
+      if (samples.sampleFormat() != AV_SAMPLE_FMT_FLT ||
+          samples.samplesCount() != stems[0].samplesCount() ||
+          (channels && samples.channelsCount() != int(channels))) {
+        err = std::make_error_code(std::errc::invalid_argument);
+        return;
+      }
+    }
+
+    if (!_map) {
+      channels = stems[0].channelsCount();
+      sampleRate = stems[0].sampleRate();
+    }
+
+    uint64_t frames = stems[0].samplesCount();
+    reserve(frameCount + frames, err);
+    if (err) {
+      return;
+    }
+
+    auto data = reinterpret_cast<float *>(_map + _dataOffset);
+    for (size_t source = 0; source < stems.size(); ++source) {
+      auto in = reinterpret_cast<const float *>(stems[source].data());
+      for (uint32_t channel = 0; channel < channels; ++channel) {
+        auto out = data + (source * channels + channel) * _capacity;
+        for (uint64_t i = 0; i < frames; ++i) {
+          out[frameCount + i] = in[i * channels + channel];
+        }
+      }
+    }
+    frameCount += frames;
+  }
+
+  if (state.isClosed) {
+    close(err);
+  }
+}
+
+// Packs the regions back to back, writes the header and truncates the file
+// to its final size.
+void SpoolSink::close(std::error_code &err) noexcept {
+  if (_fd < 0) {
+    return;
+  }
+  if (!_map) {
+    // nothing was written; still leave a valid, empty spool behind
+    if (!_capacity) {
+      reserve(1, err);
+    }
+    if (err || !_map) {
+      ::close(_fd);
+      _fd = -1;
+      return;
+    }
+  }
+
+  size_t planes = sources.size() * channels;
+  auto data = reinterpret_cast<float *>(_map + _dataOffset);
+  for (size_t plane = 1; plane < planes; ++plane) {
+    std::memmove(data + plane * frameCount, data + plane * _capacity,
+                 frameCount * sizeof(float));
+  }
+
+  SpoolHeader header{};
+  std::memcpy(header.magic, spoolMagic, sizeof(spoolMagic));
+  header.version = spoolVersion;
+  header.sampleRate = sampleRate;
+  header.channels = channels;
+  header.sourceCount = sources.size();
+  header.dataOffset = _dataOffset;
+  header.frameCount = frameCount;
+  std::memset(_map, 0, _dataOffset);
+  std::memcpy(_map, &header, sizeof(header));
+  size_t offset = sizeof(header);
+  for (const auto &source : sources) {
+    uint32_t length = source.size();
+    std::memcpy(_map + offset, &length, sizeof(length));
+    std::memcpy(_map + offset + sizeof(length), source.data(), length);
+    offset += sizeof(length) + length;
+  }
+
+  size_t mapSize = _dataOffset + _capacity * planes * sizeof(float);
+  size_t size = _dataOffset + frameCount * planes * sizeof(float);
+  if (msync(_map, mapSize, MS_SYNC) < 0) {
+    err = lastError();
+  }
+  munmap(_map, mapSize);
+  _map = nullptr;
+  if (!err && ftruncate(_fd, size) < 0) {
+    err = lastError();
+  }
+  ::close(_fd);
+  _fd = -1;
+}
+
+} // namespace audio
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "audio.hpp"
+
+namespace audio {
+
+// A spool stores every source of a separation as planar 32-bit floats in one
+// file, so that it can be memory mapped and read at any position without
+// decoding.
+//
+// File layout, native byte order:
+//   char[4] magic "STSP", u32 version, u32 sampleRate, u32 channels,
+//   u32 sourceCount, u32 dataOffset, u64 frameCount,
+//   then for every source: u32 name length, name bytes;
+//   padding up to `dataOffset`, a multiple of 64,
+//   then for every source and channel: f32 samples[frameCount].
+struct SpoolHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t sampleRate;
+  uint32_t channels;
+  uint32_t sourceCount;
+  uint32_t dataOffset;
+  uint64_t frameCount;
+};
+
+// Read-only view of a spool file. Samples are served straight from the
+// mapping and stay valid for the lifetime of the Spool.
+struct Spool {
+  std::vector<std::string> sources;
+  uint32_t sampleRate = 0;
+  uint32_t channels = 0;
+  uint64_t frameCount = 0;
+
+  Spool() = default;
+  Spool(const Spool &) = delete;
+  Spool &operator=(const Spool &) = delete;
+  ~Spool();
+
+  // Samples of one channel of a source, starting at frame `begin`. The range
+  // is clamped to the end of the spool.
+  std::span<const float>
+  samples(size_t source, size_t channel, uint64_t begin = 0,
+          uint64_t count = std::numeric_limits<uint64_t>::max()) const noexcept;
+
+  // Index of the source called `name`, or the number of sources if there is
+  // no such source.
+  size_t sourceIndex(const std::string &name) const noexcept;
+
+private:
+  friend std::unique_ptr<Spool> openSpool(const std::string &path,
+                                          std::error_code &err);
+
+  void *_map = nullptr;
+  size_t _mapSize = 0;
+  const float *_data = nullptr;
+};
+
+std::unique_ptr<Spool> openSpool(const std::string &path, std::error_code &err);
+
+// Sink writing one frame of packed float samples per source into a spool.
+// The sample rate and channel count are taken from the first frames. The
+// file is grown by remapping as frames arrive and gets its final size and
+// frame count when the stream closes. Space is allocated before it is mapped,
+// so a full disk fails a write with an error code.
+struct SpoolSink {
+  std::string path;
+  std::vector<std::string> sources;
+  uint32_t sampleRate = 0;
+  uint32_t channels = 0;
+  uint64_t frameCount = 0;
+
+  SpoolSink(const SpoolSink &) = delete;
+  SpoolSink &operator=(const SpoolSink &) = delete;
+  ~SpoolSink();
+
+  void write(const Stems &stems, PipeState state,
+             std::error_code &err) noexcept;
+
+private:
+  friend std::unique_ptr<SpoolSink>
+  openSpoolSink(const std::string &path,
+                const std::vector<std::string> &sources, std::error_code &err);
+
+  SpoolSink(const std::string &path, const std::vector<std::string> &sources,
+            int fd);
+
+  void reserve(uint64_t frames, std::error_code &err) noexcept;
+  void close(std::error_code &err) noexcept;
+
+  int _fd;
+  uint8_t *_map = nullptr;
+  size_t _dataOffset;
+  // Frames allocated per channel of every source.
+  uint64_t _capacity = 0;
+};
+
+std::unique_ptr<SpoolSink>
+openSpoolSink(const std::string &path, const std::vector<std::string> &sources,
+              std::error_code &err);
+
+} // namespace audio
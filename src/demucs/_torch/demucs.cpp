@@ -1,6 +1,14 @@
+#include <ATen/Parallel.h>
 #include <c10/core/TensorOptions.h>
+#include <cmath>
 #include <cstdint>
+#include <exception>
+#include <filesystem>
 #include <format>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <torch/serialize.h>
 
 #include "demucs.hpp"
 
@@ -9,15 +17,15 @@ namespace _torch {
 
 void print_model(const torch::jit::script::Module &model, size_t level = 0) {
   std::string indentation(level * 2, ' ');
-  std::cout << std::format("{}attrs:", indentation) << std::endl;
+  std::cerr << std::format("{}attrs:", indentation) << std::endl;
   for (const auto &attr : model.named_attributes(false)) {
-    std::cout << std::format("{}  {}:{}", indentation, attr.name,
+    std::cerr << std::format("{}  {}:{}", indentation, attr.name,
                              attr.value.type()->str())
               << std::endl;
   }
-  std::cout << indentation << "layers:" << std::endl;
+  std::cerr << indentation << "layers:" << std::endl;
   for (const auto &child : model.named_children()) {
-    std::cout << std::format("{}  {}:", indentation, child.name) << std::endl;
+    std::cerr << std::format("{}  {}:", indentation, child.name) << std::endl;
     print_model(child.value, level + 2);
   }
 }
@@ -26,9 +34,65 @@ auto dfloat(torch::Device device) {
   return torch::dtype(torch::kFloat32).device(device);
 }
 
+// Reads a bag of models: one model path per line, relative to the bag,
+// optionally followed by the model's weight for each source.
+static bool loadBag(const std::string &path, std::vector<std::string> &paths,
+                    std::vector<float> &weights, std::error_code &err) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "Error opening bag of models: " << path << std::endl;
+    err = std::make_error_code(std::errc::io_error);
+    return false;
+  }
+
+  auto dir = std::filesystem::path(path).parent_path();
+  paths.clear();
+  weights.clear();
+  std::string line;
+  size_t weighted = 0, sourceCount = 0;
+  bool valid = true;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string modulePath;
+    if (!(fields >> modulePath) || modulePath.starts_with("#")) {
+      continue;
+    }
+    paths.push_back((dir / modulePath).string());
+    size_t count = weights.size();
+    float weight;
+    while (fields >> weight) {
+      weights.push_back(weight);
+    }
+    if (weights.size() > count) {
+      // every weighted model has one weight per source
+      valid &= !weighted || weights.size() - count == sourceCount;
+      sourceCount = weights.size() - count;
+      ++weighted;
+    }
+  }
+
+  valid &= !paths.empty() && (!weighted || weighted == paths.size());
+  // weights are normalized per source, which needs a positive sum
+  for (size_t i = 0; valid && i < sourceCount; ++i) {
+    float sum = 0.;
+    for (size_t j = i; j < weights.size(); j += sourceCount) {
+      sum += weights[j];
+    }
+    valid &= sum > 0.;
+  }
+
+  if (!valid) {
+    std::cerr << "Invalid bag of models: " << path << std::endl;
+    err = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+  return true;
+}
+
 Demucs::Demucs(const std::string &path, std::error_code &err,
                demucs::Device _device, const Opts &opts)
     : device(torch::kCPU) {
+  this->opts = opts;
 
   switch (_device) {
   case demucs::Device::CPU:
@@ -44,30 +108,98 @@ Demucs::Demucs(const std::string &path, std::error_code &err,
     return;
   }
 
+  std::vector<std::string> paths = {path};
+  std::vector<float> weightValues;
+  if (path.ends_with(".bag") && !loadBag(path, paths, weightValues, err)) {
+    return;
+  }
+
   try {
-    module = torch::jit::load(path, device);
+    for (const auto &modulePath : paths) {
+      modules.push_back(torch::jit::load(modulePath, device));
+    }
   } catch (const c10::Error &e) {
     std::cerr << "Error loading torch model: " << e.what() << std::endl;
     err = std::make_error_code(std::errc::io_error);
     return;
   }
 
-  module.eval();
+  for (auto &module : modules) {
+    module.eval();
+  }
+
+  auto &module = modules.front();
 
   print_model(module);
 
   uint32_t sampleRate = module.attr("samplerate").toInt();
-  float_t segment = module.attr("segment").toDouble();
+  float_t segment =
+      opts.segment > 0 ? opts.segment : module.attr("segment").toDouble();
   uint32_t frameSize = std::floor((1. - opts.overlap) * segment * sampleRate);
   uint32_t bufferSize = std::floor(segment * sampleRate);
   auto sources = module.attr("sources").toListRef();
 
   for (const auto &source : sources) {
     std::cerr << "Source: " << source.toStringRef() << std::endl;
+    this->sources.push_back(source.toStringRef());
   }
 
   uint32_t sourceLength = module.attr("sources").toListRef().size();
 
+  // outputs are combined by index, so the sources must match in order
+  for (const auto &member : modules) {
+    auto memberSourcesValue = member.attr("sources");
+    auto memberSources = memberSourcesValue.toListRef();
+    bool agree = member.attr("samplerate").toInt() == sampleRate &&
+                 memberSources.size() == sourceLength;
+    for (size_t i = 0; agree && i < sourceLength; ++i) {
+      agree = memberSources[i].toStringRef() == this->sources[i];
+    }
+    if (!agree) {
+      std::cerr << "Bag members disagree on sample rate or sources"
+                << std::endl;
+      err = std::make_error_code(std::errc::invalid_argument);
+      return;
+    }
+  }
+
+  if (weightValues.empty()) {
+    weightValues.assign(modules.size() * sourceLength, 1.);
+  }
+  if (weightValues.size() != modules.size() * sourceLength) {
+    std::cerr << "Bag weights must have one entry per source" << std::endl;
+    err = std::make_error_code(std::errc::invalid_argument);
+    return;
+  }
+  // normalized per source, shaped to broadcast over stacked model outputs
+  weights = torch::tensor(weightValues, dfloat(device))
+                .view({(int64_t)modules.size(), sourceLength});
+  weights = (weights / weights.sum(0))
+                .view({(int64_t)modules.size(), 1, sourceLength, 1, 1});
+
+  if (opts.interOpThreads > 0) {
+    try {
+      at::set_num_interop_threads(opts.interOpThreads);
+    } catch (const c10::Error &e) {
+      // can only be set once, before any inter-op work
+      std::cerr << "Cannot set inter-op threads: " << e.what() << std::endl;
+    }
+  }
+
+  static const int defaultThreads = at::get_num_threads();
+  int threads = opts.intraOpThreads > 0 ? opts.intraOpThreads : defaultThreads;
+  if (modules.size() > 1) {
+    // members run concurrently, each on its share of the intra-op threads
+    threads = std::max<int>(1, threads / modules.size());
+    std::cerr << "Bag of " << modules.size() << " models" << std::endl;
+    _outs.resize(modules.size());
+    _errors.resize(modules.size());
+    for (size_t i = 0; i < modules.size(); ++i) {
+      _workers.emplace_back(&Demucs::work, this, i, threads);
+    }
+  }
+  at::set_num_threads(threads);
+
   std::cerr << "Demucser with model:" << std::endl;
 
   std::cerr << "Class: " << module.type()->name()->name() << std::endl;
@@ -92,7 +224,85 @@ Demucs::Demucs(const std::string &path, std::error_code &err,
   _inBuffer = torch::zeros({1, 2, bufferSize}, dfloat(device));
   _outBuffer = torch::zeros({1, sourceLength, 2, bufferSize}, dfloat(device));
   _sumWeights = torch::zeros(bufferSize, dfloat(device));
-  _outSampleSize = 0;
+}
+
+Demucs::~Demucs() {
+  {
+    std::lock_guard lock(_mutex);
+    _stopping = true;
+  }
+  _changed.notify_all();
+  for (auto &worker : _workers) {
+    worker.join();
+  }
+}
+
+// Runs a member of a bag on every forward call until the model is destroyed.
+void Demucs::work(size_t member, int threads) {
+  // OpenMP builds of torch keep the intra-op thread count per thread
+  at::set_num_threads(threads);
+
+  uint64_t generation = 0;
+  std::unique_lock lock(_mutex);
+  while (true) {
+    _changed.wait(lock,
+                  [&] { return _stopping || _generation != generation; });
+    if (_stopping) {
+      return;
+    }
+    generation = _generation;
+
+    lock.unlock();
+    torch::Tensor out;
+    std::exception_ptr error;
+    try {
+      out = modules[member].forward({*_input}).toTensor();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+
+    _outs[member] = std::move(out);
+    _errors[member] = error;
+    if (!--_running) {
+      _changed.notify_all();
+    }
+  }
+}
+
+torch::Tensor Demucs::forward(const torch::Tensor &input) {
+  if (modules.size() == 1) {
+    return modules.front().forward({input}).toTensor();
+  }
+
+  std::unique_lock lock(_mutex);
+  _input = &input;
+  _running = modules.size();
+  ++_generation;
+  _changed.notify_all();
+  _changed.wait(lock, [this] { return !_running; });
+  _input = nullptr;
+
+  std::exception_ptr error;
+  for (auto &memberError : _errors) {
+    if (!error) {
+      error = memberError;
+    }
+    memberError = nullptr;
+  }
+  auto outs = std::move(_outs);
+  _outs.assign(modules.size(), {});
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return (torch::stack(outs) * weights).sum(0);
+}
+
+bool Demucs::isSilent() const {
+  if (!std::isfinite(opts.silenceThreshold))
+    return false;
+  auto meanSquare = _inBuffer.square().mean().item<float>();
+  return 10. * std::log10(meanSquare) < opts.silenceThreshold;
 }
 
 void Demucs::write(av::AudioSamples &samples, audio::PipeState state,
@@ -103,7 +313,13 @@ void Demucs::write(av::AudioSamples &samples, audio::PipeState state,
 
   _closed = state.isClosed;
 
-  if (!state.hasFrames || state.isClosed)
+  if (state.isClosed) {
+    // separate what is left of the last batch
+    flush();
+    return;
+  }
+
+  if (!state.hasFrames)
     return;
 
   // TODO: Either this is should be moved to specialized enveloping resampler,
@@ -113,9 +329,7 @@ void Demucs::write(av::AudioSamples &samples, audio::PipeState state,
   // copy overlap to the beginning of the buffer
   auto size = _inBuffer.size(-1);
   auto overlap = _inBuffer.slice(-1, codecParams.frameSize(), size);
-  auto overlapWeights = _sumWeights.slice(0, codecParams.frameSize(), size);
   _inBuffer.slice(-1, 0, overlap.size(-1)) = overlap;
-  _sumWeights.slice(0, 0, overlap.size(-1)) = overlapWeights;
 
   // copy new samples to the end of the buffer
   auto samplesBegin = size - codecParams.frameSize();
@@ -128,44 +342,186 @@ void Demucs::write(av::AudioSamples &samples, audio::PipeState state,
   // end of stream; not sure if model is causal, so zero pad for safety
   _inBuffer.slice(-1, samplesEnd, size) = 0;
 
-  _sumWeights.slice(0, samplesBegin, size) = 0;
-  _outBuffer.slice(-1, samplesBegin, size) = 0;
-
-  auto out = module.forward({_inBuffer}).toTensor();
+  ++segmentCount;
+  _pending.push_back({
+      .window = _inBuffer.clone(),
+      .sampleCount = static_cast<int64_t>(samples.samplesCount()),
+      .silent = isSilent(),
+  });
 
-  _outBuffer += envelope * out;
-  _sumWeights += envelope;
-  _outBuffer /= _sumWeights;
-  // once again, end of stream
-  _outSampleSize = samples.samplesCount();
+  if (_pending.size() >= std::max<size_t>(1, opts.batchSize))
+    flush();
 }
 
-audio::PipeState Demucs::read(av::AudioSamples &samples, std::error_code &err) {
-  // TODO: no buffering, write - read should be interleaved
-  audio::PipeState state = {.hasFrames = !_closed, .isClosed = _closed};
+void Demucs::flush() {
+  if (_pending.empty())
+    return;
 
-  if (state.isClosed) {
-    std::cerr << std::format("Demucs::read {{.isClosed={},.hasFrames={}}}",
-                             state.isClosed, state.hasFrames)
-              << std::endl;
-    return state;
+  // separate the windows of the batch in one forward call
+  std::vector<torch::Tensor> windows;
+  for (const auto &segment : _pending) {
+    if (!segment.silent)
+      windows.push_back(segment.window);
+  }
+  torch::Tensor outs;
+  if (!windows.empty())
+    outs = forward(torch::cat(windows));
+
+  // then overlap-add them in order
+  auto size = _sumWeights.size(0);
+  auto samplesBegin = size - codecParams.frameSize();
+  int64_t separated = 0;
+  for (const auto &segment : _pending) {
+    auto overlapWeights = _sumWeights.slice(0, codecParams.frameSize(), size);
+    _sumWeights.slice(0, 0, overlapWeights.size(0)) = overlapWeights;
+
+    _sumWeights.slice(0, samplesBegin, size) = 0;
+    _outBuffer.slice(-1, samplesBegin, size) = 0;
+
+    if (segment.silent) {
+      // separates into silence; the envelope is still accumulated so that
+      // the neighbouring segments are weighted as usual
+      ++skippedSegmentCount;
+    } else {
+      _outBuffer += envelope * outs.slice(0, separated, separated + 1);
+      ++separated;
+    }
+
+    _sumWeights += envelope;
+    _outBuffer /= _sumWeights;
+
+    // the last segment of the stream may be shorter than a frame
+    _frames.push_back(_outBuffer[0]
+                          .slice(-1, samplesBegin,
+                                 samplesBegin + segment.sampleCount)
+                          .permute({0, 2, 1})
+                          .contiguous()
+                          .to(torch::kCPU));
   }
+  _pending.clear();
+}
 
+void Demucs::readSource(size_t source, const torch::Tensor &frame,
+                        av::AudioSamples &samples) {
+  auto sampleCount = frame.size(1);
   samples =
-      av::AudioSamples(codecParams.sampleFormat(), _outSampleSize,
+      av::AudioSamples(codecParams.sampleFormat(), sampleCount,
                        codecParams.channelLayout(), codecParams.sampleRate());
 
-  auto outData =
-      _outBuffer[0][0] // extract the drums only for now
-          .slice(-1, -codecParams.frameSize(),
-                 _outBuffer.size(-1) - codecParams.frameSize() + _outSampleSize)
-          .permute({1, 0})
-          .contiguous();
+  std::memcpy(samples.data(), frame[source].data_ptr<float>(),
+              sampleCount * 2 * sizeof(float));
+}
+
+audio::PipeState Demucs::read(av::AudioSamples &samples, std::error_code &err) {
+  if (_frames.empty()) {
+    audio::PipeState state = {.hasFrames = false, .isClosed = _closed};
+    if (state.isClosed) {
+      std::cerr << std::format("Demucs::read {{.isClosed={},.hasFrames={}}}",
+                               state.isClosed, state.hasFrames)
+                << std::endl;
+    }
+    return state;
+  }
+
+  readSource(0, _frames.front(), samples); // extract the drums only for now
+  _frames.pop_front();
+
+  return {.hasFrames = true};
+}
+
+audio::PipeState Demucs::read(std::vector<av::AudioSamples> &samples,
+                              std::error_code &err) {
+  if (_frames.empty()) {
+    return {.hasFrames = false, .isClosed = _closed};
+  }
+
+  samples.resize(sources.size(), av::AudioSamples(nullptr));
+  for (size_t i = 0; i < sources.size(); ++i) {
+    readSource(i, _frames.front(), samples[i]);
+  }
+  _frames.pop_front();
+
+  return {.hasFrames = true};
+}
+
+// Saved as a list of tensors: the counters and the lengths of the pending
+// segments, the overlap buffers, then the pending windows and the queued
+// frames. Pending segments are kept as they are rather than separated early,
+// so that batches are formed just like in an uninterrupted run.
+void Demucs::save(std::ostream &out, std::error_code &err) {
+  std::vector<int64_t> counts = {
+      static_cast<int64_t>(segmentCount),
+      static_cast<int64_t>(skippedSegmentCount),
+      static_cast<int64_t>(_pending.size()),
+      static_cast<int64_t>(_frames.size()),
+  };
+  for (const auto &segment : _pending) {
+    counts.push_back(segment.sampleCount);
+    counts.push_back(segment.silent);
+  }
+
+  std::vector<torch::Tensor> tensors = {torch::tensor(counts), _inBuffer,
+                                        _outBuffer, _sumWeights};
+  for (const auto &segment : _pending)
+    tensors.push_back(segment.window);
+  for (const auto &frame : _frames)
+    tensors.push_back(frame);
 
-  std::memcpy(samples.data(), outData.to(torch::kCPU).data_ptr<float>(),
-              _outSampleSize * 2 * sizeof(float));
+  try {
+    torch::save(tensors, out);
+  } catch (const c10::Error &e) {
+    std::cerr << "Error saving separation state: " << e.what() << std::endl;
+    err = std::make_error_code(std::errc::io_error);
+  }
+}
 
-  return state;
+void Demucs::load(std::istream &in, std::error_code &err) {
+  std::vector<torch::Tensor> tensors;
+  try {
+    torch::load(tensors, in, device);
+  } catch (const c10::Error &e) {
+    std::cerr << "Error loading separation state: " << e.what() << std::endl;
+    err = std::make_error_code(std::errc::io_error);
+    return;
+  }
+
+  auto invalid = [&err] {
+    std::cerr << "Separation state does not match the model" << std::endl;
+    err = std::make_error_code(std::errc::invalid_argument);
+  };
+  if (tensors.size() < 4 || tensors[0].numel() < 4) {
+    invalid();
+    return;
+  }
+  auto counts = tensors[0].to(torch::kCPU, torch::kInt64);
+  auto count = counts.data_ptr<int64_t>();
+  size_t pending = count[2], frames = count[3];
+  if (counts.numel() != static_cast<int64_t>(4 + 2 * pending) ||
+      tensors.size() != 4 + pending + frames ||
+      tensors[1].sizes() != _inBuffer.sizes() ||
+      tensors[2].sizes() != _outBuffer.sizes() ||
+      tensors[3].sizes() != _sumWeights.sizes()) {
+    invalid();
+    return;
+  }
+
+  segmentCount = count[0];
+  skippedSegmentCount = count[1];
+  _inBuffer = tensors[1];
+  _outBuffer = tensors[2];
+  _sumWeights = tensors[3];
+  _pending.clear();
+  for (size_t i = 0; i < pending; ++i) {
+    _pending.push_back({
+        .window = tensors[4 + i],
+        .sampleCount = count[4 + 2 * i],
+        .silent = count[5 + 2 * i] != 0,
+    });
+  }
+  _frames.clear();
+  for (size_t i = 0; i < frames; ++i)
+    _frames.push_back(tensors[4 + pending + i].to(torch::kCPU));
+  _closed = false;
 }
 
 } // namespace _torch
@@ -2,8 +2,14 @@
 
 #include <avcpp/codec.h>
 #include <avcpp/codeccontext.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <torch/script.h>
+#include <vector>
 
 #include "../../audio/audio.hpp"
 #include "../demucs.hpp"
@@ -13,7 +19,10 @@ namespace _torch {
 
 struct Demucs : public demucs::Demucs {
   torch::Device device;
-  torch::jit::script::Module module;
+  // A single model, or the members of a bag of models.
+  std::vector<torch::jit::script::Module> modules;
+  // Per source weight of each member, normalized over the members.
+  torch::Tensor weights;
   torch::Tensor envelope;
   Demucs(const std::string &path, std::error_code &err,
          const demucs::Device device = demucs::Device::CPU,
@@ -22,12 +31,45 @@ struct Demucs : public demucs::Demucs {
                      std::error_code &err) override;
   virtual audio::PipeState read(av::AudioSamples &samples,
                                 std::error_code &err) override;
-  virtual ~Demucs() = default;
+  virtual audio::PipeState read(std::vector<av::AudioSamples> &samples,
+                                std::error_code &err) override;
+  virtual void save(std::ostream &out, std::error_code &err) override;
+  virtual void load(std::istream &in, std::error_code &err) override;
+  virtual ~Demucs();
 
 private:
-  uint64_t _outSampleSize;
-  bool _closed;
+  struct Segment {
+    torch::Tensor window;
+    int64_t sampleCount;
+    bool silent;
+  };
+
+  torch::Tensor forward(const torch::Tensor &input);
+  void work(size_t member, int threads);
+  void flush();
+  bool isSilent() const;
+  void readSource(size_t source, const torch::Tensor &frame,
+                  av::AudioSamples &samples);
+  bool _closed = false;
   torch::Tensor _inBuffer, _outBuffer, _sumWeights;
+  // Segments waiting to be separated as one batch.
+  std::vector<Segment> _pending;
+  // Separated frames waiting to be read, shaped [sources, samples, 2].
+  std::deque<torch::Tensor> _frames;
+
+  // Threads running the members of a bag, one per member, each handed the
+  // input of every forward call.
+  std::vector<std::thread> _workers;
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  const torch::Tensor *_input = nullptr;
+  // Counts forward calls, so that a worker runs each one once.
+  uint64_t _generation = 0;
+  // Members still working on the current forward call.
+  size_t _running = 0;
+  bool _stopping = false;
+  std::vector<torch::Tensor> _outs;
+  std::vector<std::exception_ptr> _errors;
 };
 
 } // namespace _torch
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+#include "autotune.hpp"
+
+namespace fs = std::filesystem;
+
+namespace demucs {
+
+std::string profilePath() {
+  if (auto path = std::getenv("STEMTOOLS_PROFILE")) {
+    return path;
+  }
+  fs::path cache;
+  if (auto xdgCache = std::getenv("XDG_CACHE_HOME")) {
+    cache = xdgCache;
+  } else if (auto home = std::getenv("HOME")) {
+    cache = fs::path(home) / ".cache";
+  } else {
+    cache = fs::temp_directory_path();
+  }
+  return (cache / "stemtools" / "autotune.tsv").string();
+}
+
+std::string cpuModel() {
+#ifdef __APPLE__
+  char brand[256];
+  size_t size = sizeof(brand);
+  if (!sysctlbyname("machdep.cpu.brand_string", brand, &size, nullptr, 0)) {
+    return brand;
+  }
+#else
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.starts_with("model name")) {
+      auto value = line.find(':');
+      if (value != std::string::npos) {
+        return line.substr(line.find_first_not_of(" \t", value + 1));
+      }
+    }
+  }
+#endif
+  return "unknown";
+}
+
+std::vector<std::string> modelFiles(const std::string &path) {
+  std::vector<std::string> files = {path};
+  if (!path.ends_with(".bag")) {
+    return files;
+  }
+  // one member path per line, relative to the bag, like loadBag reads them
+  std::ifstream bag(path);
+  auto dir = fs::path(path).parent_path();
+  std::string line;
+  while (std::getline(bag, line)) {
+    std::istringstream fields(line);
+    std::string member;
+    if (fields >> member && !member.starts_with("#")) {
+      files.push_back((dir / member).string());
+    }
+  }
+  return files;
+}
+
+uint64_t fnv1a(const void *data, size_t length, uint64_t hash) {
+  constexpr uint64_t fnvPrime = 1099511628211ull;
+  auto bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ bytes[i]) * fnvPrime;
+  }
+  return hash;
+}
+
+std::string modelHash(const std::string &path) {
+  constexpr std::streamoff chunkSize = 1 << 20;
+
+  uint64_t hash = fnv1aOffset;
+  std::vector<char> chunk(chunkSize);
+  for (const auto &file : modelFiles(path)) {
+    std::ifstream stream(file, std::ios::binary | std::ios::ate);
+    std::streamoff size =
+        stream ? static_cast<std::streamoff>(stream.tellg()) : 0;
+    hash = fnv1a(&size, sizeof(size), hash);
+
+    auto tail = std::max<std::streamoff>(size - chunkSize, 0);
+    for (auto offset : {std::streamoff(0), tail}) {
+      stream.seekg(offset);
+      stream.read(chunk.data(), chunk.size());
+      hash = fnv1a(chunk.data(), stream.gcount(), hash);
+      stream.clear();
+    }
+  }
+
+  return std::format("{:016x}", hash);
+}
+
+// Identifies what a tuning was measured on: the host, the model, the device
+// and the segment length, which sets the work of every forward call. Ends in
+// a tab, followed by the tuned values in the profile.
+static std::string tuningKey(const std::string &modelPath, Device device,
+                             const Opts &opts) {
+  auto name = std::find_if(deviceMap.begin(), deviceMap.end(),
+                           [device](const auto &entry) {
+                             return entry.second == device;
+                           });
+  return std::format("{}\t{}\t{}\t{}\t", cpuModel(), modelHash(modelPath),
+                     name != deviceMap.end() ? name->first : "unknown",
+                     opts.segment);
+}
+
+bool loadTuning(const std::string &modelPath, Device device, Opts &opts) {
+  std::ifstream profile(profilePath());
+  if (!profile) {
+    return false;
+  }
+
+  auto key = tuningKey(modelPath, device, opts);
+  std::string line;
+  while (std::getline(profile, line)) {
+    if (!line.starts_with(key)) {
+      continue;
+    }
+    std::istringstream fields(line.substr(key.size()));
+    Opts tuned = opts;
+    if (fields >> tuned.batchSize >> tuned.intraOpThreads >>
+        tuned.interOpThreads) {
+      opts = tuned;
+      return true;
+    }
+  }
+  return false;
+}
+
+void saveTuning(const std::string &modelPath, Device device, const Opts &opts,
+                std::error_code &err) {
+  auto path = profilePath();
+  auto key = tuningKey(modelPath, device, opts);
+
+  // keep the entries of other hosts and models
+  std::vector<std::string> lines;
+  {
+    std::ifstream profile(path);
+    std::string line;
+    while (std::getline(profile, line)) {
+      if (!line.starts_with(key)) {
+        lines.push_back(line);
+      }
+    }
+  }
+  lines.push_back(std::format("{}{}\t{}\t{}", key, opts.batchSize,
+                              opts.intraOpThreads, opts.interOpThreads));
+
+  fs::create_directories(fs::path(path).parent_path(), err);
+  if (err) {
+    return;
+  }
+  auto tmpPath = path + ".tmp";
+  {
+    std::ofstream profile(tmpPath, std::ios::trunc);
+    for (const auto &line : lines) {
+      profile << line << '\n';
+    }
+    if (!profile.flush()) {
+      err = std::make_error_code(std::errc::io_error);
+      return;
+    }
+  }
+  fs::rename(tmpPath, path, err);
+}
+
+// Seconds per segment of separating synthetic noise, after a warm-up that
+// lets the JIT specialize the model.
+static double benchmark(Demucs &demucs, std::error_code &err) {
+  const auto &params = demucs.codecParams;
+  av::AudioSamples samples(params.sampleFormat(), params.frameSize(),
+                           params.channelLayout(), params.sampleRate());
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(0., .1);
+  auto data = reinterpret_cast<float *>(samples.data());
+  for (size_t i = 0; i < params.frameSize() * 2; ++i) {
+    data[i] = noise(rng);
+  }
+
+  auto segments = 2 * std::max<size_t>(1, demucs.opts.batchSize);
+  av::AudioSamples out(nullptr);
+  auto separate = [&](size_t count) {
+    for (size_t i = 0; i < count && !err; ++i) {
+      demucs.write(samples, {.hasFrames = true}, err);
+      while (!err && demucs.read(out, err).hasFrames) {
+      }
+    }
+  };
+
+  separate(segments);
+  auto start = std::chrono::steady_clock::now();
+  separate(segments);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / segments;
+}
+
+Opts autotune(const std::string &modelPath, std::error_code &err,
+              const Device device, const Opts &opts) {
+  std::vector<size_t> batchSizes = {1, 2, 4, 8};
+  std::vector<int> threadCounts;
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 1; threads < cores; threads *= 2) {
+    threadCounts.push_back(threads);
+  }
+  threadCounts.push_back(cores);
+
+  Opts best = opts;
+  double bestSeconds = std::numeric_limits<double>::infinity();
+  for (auto batchSize : batchSizes) {
+    for (auto threads : threadCounts) {
+      Opts candidate = opts;
+      candidate.batchSize = batchSize;
+      candidate.intraOpThreads = threads;
+
+      auto demucs = openDemucs(modelPath, err, device, candidate);
+      if (err) {
+        return opts;
+      }
+      auto seconds = benchmark(*demucs, err);
+      if (err) {
+        return opts;
+      }
+
+      std::cerr << std::format("Autotune: batch size {}, {} threads: {:.3f}s "
+                               "per segment",
+                               batchSize, threads, seconds)
+                << std::endl;
+      if (seconds < bestSeconds) {
+        bestSeconds = seconds;
+        best = candidate;
+      }
+    }
+  }
+  return best;
+}
+
+} // namespace demucs
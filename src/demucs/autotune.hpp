@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "demucs.hpp"
+
+namespace demucs {
+
+// Path of the per-host tuning profile: $STEMTOOLS_PROFILE if set, otherwise
+// autotune.tsv in the stemtools directory of the user's cache.
+std::string profilePath();
+
+// CPU model of the host, as reported by the OS.
+std::string cpuModel();
+
+// Offset basis of 64-bit FNV-1a, i.e. the hash of no data.
+constexpr uint64_t fnv1aOffset = 14695981039346656037ull;
+
+// Continues a 64-bit FNV-1a `hash` over `length` bytes of `data`.
+uint64_t fnv1a(const void *data, size_t length, uint64_t hash = fnv1aOffset);
+
+// Files a model consists of: the model file, followed by the member models
+// if it is a bag.
+std::vector<std::string> modelFiles(const std::string &path);
+
+// Cheap fingerprint of a model: the size and the contents of the head and
+// tail of each of its files.
+std::string modelHash(const std::string &path);
+
+// Applies the batch size and thread counts stored for this host, model,
+// device and segment length of `opts` to `opts`. Returns false if the
+// profile has no entry for them.
+bool loadTuning(const std::string &modelPath, Device device, Opts &opts);
+
+// Stores the batch size and thread counts of `opts` for this host, model,
+// device and segment length.
+void saveTuning(const std::string &modelPath, Device device, const Opts &opts,
+                std::error_code &err);
+
+// Times a short synthetic separation for every combination of batch size and
+// intra-op thread count, and returns `opts` with the fastest combination.
+Opts autotune(const std::string &modelPath, std::error_code &err,
+              const Device device = Device::CPU,
+              const Opts &opts = defaultDemucsOpts);
+
+} // namespace demucs
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Interrupts a checkpointed separation, resumes it and checks that the output
+# matches that of an uninterrupted run byte for byte. Runs the model exported
+# by make-fixture.py, so it needs python3 with torch. Inputs at the model's
+# rate and at rates it resamples from are checked, the latter exercising the
+# alignment and preroll of resuming.
+#
+# Usage: checkpoint-test.sh <demucs-test>
+
+set -eu
+
+demucs_test=$1
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# keep a stored tuning from changing the options between runs
+export STEMTOOLS_PROFILE="$tmp/autotune.tsv"
+
+python3 "$dir/make-fixture.py" "$tmp/fixture.pt"
+
+# check <sample rate>
+check() {
+  run="$tmp/$1"
+  mkdir "$run" "$run/whole" "$run/resumed"
+
+  python3 - "$run/input.wav" "$1" <<'EOF'
+import random
+import struct
+import sys
+import wave
+
+# a minute of stereo noise with a varying level, so that every segment
+# differs
+rate = int(sys.argv[2])
+rng = random.Random(0)
+with wave.open(sys.argv[1], "wb") as out:
+    out.setnchannels(2)
+    out.setsampwidth(2)
+    out.setframerate(rate)
+    for second in range(60):
+        level = 2000 + 1000 * (second % 7)
+        samples = [rng.randint(-level, level) for _ in range(2 * rate)]
+        out.writeframes(struct.pack(f"<{len(samples)}h", *samples))
+EOF
+
+  "$demucs_test" "$tmp/fixture.pt" "$run/input.wav" "$run/whole" \
+    2>"$run/whole.log" || { cat "$run/whole.log" >&2; return 1; }
+
+  # take a checkpoint after every frame and stop reading the log after a few
+  # of them; the run dies writing to the closed pipe, or at the latest by the
+  # kill
+  mkfifo "$run/log"
+  "$demucs_test" --checkpoint --checkpoint-interval 0 "$tmp/fixture.pt" \
+    "$run/input.wav" "$run/resumed" 2>"$run/log" &
+  pid=$!
+  grep -m 3 "^Checkpoint at" "$run/log" >/dev/null || true
+  kill -9 "$pid" 2>/dev/null || true
+  wait "$pid" 2>/dev/null || true
+
+  # a finished run removes its checkpoint
+  if [ ! -f "$run/resumed/out.ckpt" ]; then
+    echo "$1 Hz: run finished or failed before it could be interrupted" >&2
+    return 1
+  fi
+
+  "$demucs_test" --checkpoint "$tmp/fixture.pt" "$run/input.wav" \
+    "$run/resumed" 2>"$run/resume.log" ||
+    { cat "$run/resume.log" >&2; return 1; }
+  if ! grep -q "^Resuming from" "$run/resume.log"; then
+    echo "$1 Hz: run did not resume from the checkpoint" >&2
+    return 1
+  fi
+
+  if ! cmp "$run/whole/out.wav" "$run/resumed/out.wav"; then
+    echo "$1 Hz: resumed output differs" >&2
+    return 1
+  fi
+}
+
+status=0
+for rate in 44100 48000 22050; do
+  check "$rate" || status=1
+done
+exit $status
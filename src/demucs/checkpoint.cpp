@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+#include "autotune.hpp"
+#include "checkpoint.hpp"
+
+namespace fs = std::filesystem;
+
+namespace demucs {
+
+// Seconds of input decoded ahead of a checkpoint's position on resume.
+constexpr int64_t prerollSeconds = 1;
+
+// FNV-1a of the full contents of every file of a model. Unlike modelHash,
+// which only samples the files, a change anywhere in the weights is caught.
+static std::string modelDigest(const std::string &modelPath) {
+  uint64_t hash = fnv1aOffset;
+  std::vector<char> chunk(1 << 20);
+  for (const auto &file : modelFiles(modelPath)) {
+    std::ifstream stream(file, std::ios::binary);
+    while (stream) {
+      stream.read(chunk.data(), chunk.size());
+      hash = fnv1a(chunk.data(), stream.gcount(), hash);
+    }
+    // separates the files, and marks those missing
+    const uint8_t separator = 0xff;
+    hash = fnv1a(&separator, sizeof(separator), hash);
+  }
+  return std::format("{:016x}", hash);
+}
+
+std::string checkpointKey(const std::string &modelPath, const Opts &opts) {
+  return std::format("{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t",
+                     modelDigest(modelPath), opts.segment, opts.overlap,
+                     opts.transitionPower, opts.silenceThreshold,
+                     opts.batchSize, opts.intraOpThreads,
+                     opts.interOpThreads);
+}
+
+// File layout: a line of the tab separated checkpoint key, input frames and
+// output offset, followed by the state of the model as saved by
+// Demucs::save.
+void saveCheckpoint(const std::string &path, const std::string &key,
+                    const Checkpoint &checkpoint, Demucs &demucs,
+                    std::error_code &err) {
+  // torch::save writes an archive that torch::load only finds at the start
+  // of a stream, so it goes through a buffer of its own
+  std::ostringstream state;
+  demucs.save(state, err);
+  if (err) {
+    return;
+  }
+
+  auto tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file << key << checkpoint.inputFrames << '\t' << checkpoint.outputOffset
+         << '\n'
+         << state.view();
+    if (!file.flush()) {
+      err = std::make_error_code(std::errc::io_error);
+      return;
+    }
+  }
+  fs::rename(tmpPath, path, err);
+}
+
+bool loadCheckpoint(const std::string &path, const std::string &key,
+                    Checkpoint &checkpoint, Demucs &demucs,
+                    std::error_code &err) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  std::string line;
+  std::getline(file, line);
+  std::istringstream fields(line.starts_with(key) ? line.substr(key.size())
+                                                  : "");
+  if (!(fields >> checkpoint.inputFrames >> checkpoint.outputOffset)) {
+    std::cerr << "Checkpoint " << path
+              << " was not taken with this model and options" << std::endl;
+    err = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+
+  // the archive has to start its own stream, see saveCheckpoint
+  std::istringstream state(
+      std::string(std::istreambuf_iterator<char>(file), {}));
+  demucs.load(state, err);
+  return !err;
+}
+
+// Frames of `samples` from `offset` on.
+static av::AudioSamples tail(const av::AudioSamples &samples, int64_t offset) {
+  int64_t count = samples.samplesCount() - offset;
+  av::AudioSamples out(samples.sampleFormat(), count, samples.channelsLayout(),
+                       samples.sampleRate());
+  av_samples_copy(out.raw()->extended_data,
+                  const_cast<uint8_t **>(samples.raw()->extended_data), 0,
+                  offset, count, samples.channelsCount(),
+                  samples.sampleFormat());
+  return out;
+}
+
+void seekCheckpoint(audio::FileSource &source, audio::Resampler &resampler,
+                    const Checkpoint &checkpoint, std::error_code &err) {
+  int64_t sourceRate = source.adecContext.sampleRate();
+  int64_t modelRate = resampler.resampler.dstSampleRate();
+
+  // the resampled frames line up with those of the interrupted run only when
+  // resampling starts on a source frame that falls on a model frame
+  int64_t step = sourceRate / std::gcd(sourceRate, modelRate);
+  int64_t target = checkpoint.inputFrames * sourceRate / modelRate -
+                   prerollSeconds * sourceRate;
+  target = std::max<int64_t>(target, 0) / step * step;
+
+  source.seek(target, err);
+  if (err) {
+    return;
+  }
+
+  // skip to the first frame on a step, within the first samples decoded
+  auto stream = source.stream.raw();
+  av::Rational sampleTime(1, sourceRate);
+  int64_t startTime = stream->start_time == AV_NOPTS_VALUE
+                          ? 0
+                          : av::Timestamp(stream->start_time,
+                                          stream->time_base)
+                                .timestamp(sampleTime);
+  av::AudioSamples samples(nullptr);
+  std::optional<int64_t> position;
+  int64_t offset = 0;
+  while (true) {
+    auto state = source.read(samples, err);
+    if (err) {
+      return;
+    }
+    if (state.isClosed) {
+      std::cerr << "Source ended before the checkpoint" << std::endl;
+      err = std::make_error_code(std::errc::invalid_seek);
+      return;
+    }
+    if (!state.hasFrames || !samples || !samples.samplesCount()) {
+      continue;
+    }
+
+    if (!position) {
+      if (samples.pts().timestamp() == av::NoPts) {
+        std::cerr << "Source has no timestamps to resume from" << std::endl;
+        err = std::make_error_code(std::errc::not_supported);
+        return;
+      }
+      position = samples.pts().timestamp(sampleTime) - startTime;
+      offset = (step - *position % step) % step;
+    }
+    if (offset < static_cast<int64_t>(samples.samplesCount())) {
+      break;
+    }
+    offset -= samples.samplesCount();
+    *position += samples.samplesCount();
+  }
+
+  // a whole number of model frames, as `aligned` is on a step
+  int64_t aligned = *position + offset;
+  int64_t start = aligned * modelRate / sourceRate;
+  if (aligned < 0 || start > checkpoint.inputFrames) {
+    std::cerr << "Source cannot be seeked to the checkpoint" << std::endl;
+    err = std::make_error_code(std::errc::invalid_seek);
+    return;
+  }
+
+  resampler.write(offset ? tail(samples, offset) : samples,
+                  {.hasFrames = true}, err);
+  resampler.skip = checkpoint.inputFrames - start;
+}
+
+void CheckpointSink::write(const av::AudioSamples &samples,
+                           audio::PipeState state,
+                           std::error_code &err) noexcept {
+  sink.write(samples, state, err);
+  if (err || !state.hasFrames || state.isClosed) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (now - last < interval || resampler.resampler.delay() > 0) {
+    return;
+  }
+
+  Checkpoint checkpoint = {
+      .inputFrames = static_cast<int64_t>(demucs.segmentCount *
+                                          demucs.codecParams.frameSize()),
+  };
+  checkpoint.outputOffset = sink.flush(err);
+  if (err) {
+    return;
+  }
+  saveCheckpoint(path, key, checkpoint, demucs, err);
+  if (err) {
+    return;
+  }
+  std::cerr << std::format("Checkpoint at {:.1f}s of input",
+                           double(checkpoint.inputFrames) /
+                               demucs.codecParams.sampleRate())
+            << std::endl;
+  last = now;
+}
+
+} // namespace demucs
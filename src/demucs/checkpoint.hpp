@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+#include "../audio/audio.hpp"
+#include "demucs.hpp"
+
+namespace demucs {
+
+// Progress of a separation writing to a file, saved periodically so that an
+// interrupted run can be resumed where it left off.
+struct Checkpoint {
+  // Frames of the input written to the model, at the model's sample rate.
+  int64_t inputFrames = 0;
+  // Bytes of the output written, see audio::FileSink::flush.
+  int64_t outputOffset = 0;
+};
+
+// Identifies what a checkpoint can be resumed with: the full contents of the
+// model's files, and the options that change the separated samples.
+std::string checkpointKey(const std::string &modelPath, const Opts &opts);
+
+// Saves a checkpoint under `key` together with the state of `demucs`,
+// replacing the previous one atomically.
+void saveCheckpoint(const std::string &path, const std::string &key,
+                    const Checkpoint &checkpoint, Demucs &demucs,
+                    std::error_code &err);
+
+// Loads a checkpoint and the state of `demucs` saved with it. Returns false if
+// there is no checkpoint at `path`; a checkpoint saved under another key is an
+// error.
+bool loadCheckpoint(const std::string &path, const std::string &key,
+                    Checkpoint &checkpoint, Demucs &demucs,
+                    std::error_code &err);
+
+// Seeks `source` to shortly before the input position of a checkpoint and
+// sets `resampler`, converting to the model's format, to skip what precedes
+// it. Decoding and resampling a little ahead of the position lets both settle
+// on the same output as the interrupted run.
+void seekCheckpoint(audio::FileSource &source, audio::Resampler &resampler,
+                    const Checkpoint &checkpoint, std::error_code &err);
+
+// Sink that saves a checkpoint every `interval` while passing frames on to
+// the output. Taken only once the frames separated so far have all reached
+// the output, i.e. when `resampler`, converting the separated frames for the
+// output, holds none.
+struct CheckpointSink {
+  audio::FileSink &sink;
+  audio::Resampler &resampler;
+  Demucs &demucs;
+  std::string path;
+  // See checkpointKey.
+  std::string key;
+  std::chrono::seconds interval;
+
+  // When the last checkpoint was taken, or the sink was created.
+  std::chrono::steady_clock::time_point last =
+      std::chrono::steady_clock::now();
+
+  void write(const av::AudioSamples &samples, audio::PipeState state,
+             std::error_code &err) noexcept;
+};
+
+} // namespace demucs
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <argparse/argparse.hpp>
+
+#include "../audio/audio.hpp"
+#include "autotune.hpp"
+#include "demucs.hpp"
+
+// Interleaved stereo float samples at the model sample rate.
+using Waveform = std::vector<float>;
+
+struct Result {
+  demucs::Opts opts;
+  double seconds;
+  double realTimeFactor;
+  std::string skippedSegments;
+  std::vector<double> sdr;
+  double meanSdr;
+  bool pareto;
+};
+
+void append(Waveform &waveform, const av::AudioSamples &samples) {
+  auto data = reinterpret_cast<const float *>(samples.data());
+  waveform.insert(waveform.end(), data,
+                  data + samples.samplesCount() * samples.channelsCount());
+}
+
+Waveform decode(const std::string &path, const demucs::CodecParams &params,
+                std::error_code &err) {
+  Waveform waveform;
+  auto source = audio::openSource(path, err);
+  if (err)
+    return waveform;
+
+  audio::Resampler resampler(source->adecContext, params, err);
+  if (err)
+    return waveform;
+
+  auto chain = *source >> resampler;
+  audio::PipeState state{};
+  av::AudioSamples samples(nullptr);
+  while (!state.isClosed) {
+    state = chain.read(samples, err);
+    if (err)
+      break;
+    if (state.hasFrames)
+      append(waveform, samples);
+  }
+  return waveform;
+}
+
+// Decodes the mixture from memory and separates it, timing everything but
+// loading the model.
+std::vector<Waveform> separate(demucs::Demucs &demucs,
+                               std::span<const uint8_t> mixture,
+                               double &seconds, std::error_code &err) {
+  std::vector<Waveform> estimates(demucs.sources.size());
+  auto start = std::chrono::steady_clock::now();
+
+  auto source = audio::openSource(mixture, err);
+  if (err)
+    return estimates;
+
+  audio::Resampler resampler(source->adecContext, demucs.codecParams, err);
+  if (err)
+    return estimates;
+
+  auto chain = *source >> resampler;
+  audio::PipeState state{};
+  av::AudioSamples samples(nullptr);
+  std::vector<av::AudioSamples> outputs;
+  while (!state.isClosed) {
+    state = chain.read(samples, err);
+    if (err)
+      break;
+
+    if (!state.hasFrames && !state.isClosed)
+      continue;
+
+    demucs.write(samples, state, err);
+    if (err)
+      break;
+
+    state = demucs.read(outputs, err);
+    if (err)
+      break;
+
+    if (state.hasFrames) {
+      for (size_t i = 0; i < outputs.size(); ++i)
+        append(estimates[i], outputs[i]);
+    }
+  }
+
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+                .count();
+  return estimates;
+}
+
+// Signal-to-distortion ratio in dB as defined for the Music Demixing
+// Challenge. Samples missing from the estimate count as silence.
+double sdr(const Waveform &reference, const Waveform &estimate) {
+  constexpr double eps = 1e-7;
+  double signal = eps, distortion = eps;
+  for (size_t i = 0; i < reference.size(); ++i) {
+    double ref = reference[i];
+    double est = i < estimate.size() ? estimate[i] : 0.;
+    signal += ref * ref;
+    distortion += (ref - est) * (ref - est);
+  }
+  return 10. * std::log10(signal / distortion);
+}
+
+void markPareto(std::vector<Result> &results) {
+  for (auto &result : results) {
+    result.pareto = std::none_of(
+        results.begin(), results.end(), [&result](const Result &other) {
+          return other.realTimeFactor <= result.realTimeFactor &&
+                 other.meanSdr >= result.meanSdr &&
+                 (other.realTimeFactor < result.realTimeFactor ||
+                  other.meanSdr > result.meanSdr);
+        });
+  }
+}
+
+int main(int argc, char **argv) {
+  argparse::ArgumentParser program("demucs-eval");
+
+  program.add_argument("model").help(
+      "Path to the model file. Engine can be either Torch or ONNX, determined "
+      "by the file extension. A .bag file lists Torch models to ensemble");
+  program.add_argument("mixture").help("Path to the mixture audio file");
+  program.add_argument("references")
+      .nargs(argparse::nargs_pattern::at_least_one)
+      .help("Paths to the reference stems, in the order of the model sources");
+
+  program.add_argument("-d", "--device")
+      .default_value("cpu")
+      .choices("cpu", "cuda", "metal")
+      .help("Device to run the model on. Defaults to cpu");
+  program.add_argument("--overlap")
+      .nargs(argparse::nargs_pattern::at_least_one)
+      .default_value(std::vector<float>{demucs::defaultDemucsOpts.overlap})
+      .scan<'g', float>()
+      .help("Overlap ratios to evaluate");
+  program.add_argument("--transition-power")
+      .nargs(argparse::nargs_pattern::at_least_one)
+      .default_value(
+          std::vector<float>{demucs::defaultDemucsOpts.transitionPower})
+      .scan<'g', float>()
+      .help("Transition powers to evaluate");
+  program.add_argument("--segment")
+      .nargs(argparse::nargs_pattern::at_least_one)
+      .default_value(std::vector<float>{demucs::defaultDemucsOpts.segment})
+      .scan<'g', float>()
+      .help("Segment lengths in seconds to evaluate. 0 uses the model's own");
+  program.add_argument("--silence-threshold")
+      .nargs(argparse::nargs_pattern::at_least_one)
+      .default_value(
+          std::vector<float>{demucs::defaultDemucsOpts.silenceThreshold})
+      .scan<'g', float>()
+      .help("Silence thresholds in dBFS to evaluate. Disabled by default");
+  program.add_argument("-o", "--output").help(
+      "Path to write the result table to. Defaults to stdout");
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::exception &err) {
+    std::cerr << err.what() << std::endl;
+    std::cerr << program;
+    std::exit(1);
+  }
+
+  std::string modelFile = program.get<std::string>("model");
+  std::string mixtureFile = program.get<std::string>("mixture");
+  auto referenceFiles = program.get<std::vector<std::string>>("references");
+  auto device = demucs::deviceMap[program.get<std::string>("--device")];
+
+  std::error_code err;
+
+  audio::init();
+
+  // keep the mixture in memory so that file IO is not part of the timings
+  std::ifstream mixtureStream(mixtureFile, std::ios::binary);
+  if (!mixtureStream) {
+    std::cerr << "Error opening mixture: " << mixtureFile << std::endl;
+    return -1;
+  }
+  std::vector<uint8_t> mixture(std::istreambuf_iterator<char>(mixtureStream),
+                               {});
+
+  std::vector<Waveform> references;
+  std::vector<std::string> sources;
+  std::vector<Result> results;
+
+  std::vector<demucs::Opts> grid;
+  for (auto segment : program.get<std::vector<float>>("--segment"))
+    for (auto overlap : program.get<std::vector<float>>("--overlap"))
+      for (auto transitionPower :
+           program.get<std::vector<float>>("--transition-power"))
+        for (auto silenceThreshold :
+             program.get<std::vector<float>>("--silence-threshold")) {
+          auto opts = demucs::defaultDemucsOpts;
+          opts.transitionPower = transitionPower;
+          opts.overlap = overlap;
+          opts.segment = segment;
+          opts.silenceThreshold = silenceThreshold;
+          demucs::loadTuning(modelFile, device, opts);
+          grid.push_back(opts);
+        }
+
+  for (const auto &opts : grid) {
+    auto demucs = demucs::openDemucs(modelFile, err, device, opts);
+    if (err) {
+      std::cerr << "Error opening model: " << err.message() << std::endl;
+      return -1;
+    }
+
+    if (references.empty()) {
+      sources = demucs->sources;
+      if (referenceFiles.size() != sources.size()) {
+        std::cerr << std::format("Model has {} sources, got {} references",
+                                 sources.size(), referenceFiles.size())
+                  << std::endl;
+        return -1;
+      }
+      for (const auto &referenceFile : referenceFiles) {
+        references.push_back(decode(referenceFile, demucs->codecParams, err));
+        if (err) {
+          std::cerr << "Error decoding reference " << referenceFile << ": "
+                    << err.message() << std::endl;
+          return -1;
+        }
+      }
+    }
+
+    Result result = {.opts = opts};
+    auto estimates = separate(*demucs, mixture, result.seconds, err);
+    if (err) {
+      std::cerr << "Error running graph: " << err.message() << std::endl;
+      return -1;
+    }
+
+    double duration =
+        estimates[0].size() / 2. / demucs->codecParams.sampleRate();
+    result.realTimeFactor = result.seconds / duration;
+    result.skippedSegments = std::format("{}/{}", demucs->skippedSegmentCount,
+                                         demucs->segmentCount);
+    result.meanSdr = 0.;
+    for (size_t i = 0; i < sources.size(); ++i) {
+      result.sdr.push_back(sdr(references[i], estimates[i]));
+      result.meanSdr += result.sdr.back() / sources.size();
+    }
+    results.push_back(result);
+  }
+
+  markPareto(results);
+
+  std::ofstream outputFile;
+  if (program.present("--output")) {
+    outputFile.open(program.get<std::string>("--output"));
+    if (!outputFile) {
+      std::cerr << "Error opening output file" << std::endl;
+      return -1;
+    }
+  }
+  std::ostream &output = outputFile.is_open() ? outputFile : std::cout;
+
+  output << "segment\toverlap\ttransition_power\tsilence_threshold\tseconds"
+            "\trtf\tskipped";
+  for (const auto &source : sources)
+    output << "\tsdr_" << source;
+  output << "\tsdr_mean\tpareto" << std::endl;
+
+  for (const auto &result : results) {
+    output << std::format("{}\t{}\t{}\t{}\t{:.3f}\t{:.4f}\t{}",
+                          result.opts.segment, result.opts.overlap,
+                          result.opts.transitionPower,
+                          result.opts.silenceThreshold, result.seconds,
+                          result.realTimeFactor, result.skippedSegments);
+    for (auto value : result.sdr)
+      output << std::format("\t{:.3f}", value);
+    output << std::format("\t{:.3f}\t{}", result.meanSdr, result.pareto)
+           << std::endl;
+  }
+}
@@ -1,26 +1,82 @@
+#include <chrono>
+#include <filesystem>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <system_error>
+#include <vector>
 
 #include <argparse/argparse.hpp>
 
 #include "../audio/audio.hpp"
+#include "../audio/coro.hpp"
+#include "../audio/peaks.hpp"
+#include "../audio/spool.hpp"
+#include "autotune.hpp"
+#include "checkpoint.hpp"
 #include "demucs.hpp"
 
+// Peaks file of every source, next to the output as out.<source>.peaks.
+std::vector<std::string> peaksPaths(const std::string &odir,
+                                    const std::vector<std::string> &sources) {
+  std::vector<std::string> paths;
+  for (const auto &source : sources)
+    paths.push_back(odir + "/out." + source + ".peaks");
+  return paths;
+}
+
 int main(int argc, char **argv) {
   argparse::ArgumentParser program("demucs-test");
 
   program.add_argument("model").help(
       "Path to the model file. Engine can be either Torch or ONNX, determined "
-      "by the file extension");
-  program.add_argument("input").help("Path to the input audio file");
-  program.add_argument("output").help("Path to the output directory");
+      "by the file extension. A .bag file lists Torch models to ensemble");
+  program.add_argument("input").help(
+      "Path to the input audio file, or - to read from stdin");
+  program.add_argument("output").help(
+      "Path to the output directory, or - to write WAV to stdout");
 
   program.add_argument("-d", "--device")
       .default_value("cpu")
       .choices("cpu", "cuda", "metal")
       .help("Device to run the model on. Defaults to cpu");
 
+  program.add_argument("--silence-threshold")
+      .default_value(demucs::defaultDemucsOpts.silenceThreshold)
+      .scan<'g', float>()
+      .help("Skip separating segments quieter than this RMS level in dBFS. "
+            "Disabled by default");
+
+  program.add_argument("--autotune")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Benchmark batch sizes and thread counts for this host and model, "
+            "and store the fastest in the tuning profile. Otherwise a stored "
+            "tuning is applied when present");
+
+  program.add_argument("--peaks")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Write waveform peak data of every source next to the output as "
+            "out.<source>.peaks");
+
+  program.add_argument("--spool")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Write every source as planar float samples to out.spool instead "
+            "of mixing them down to out.wav");
+
+  program.add_argument("--checkpoint")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Periodically save the progress to out.ckpt, and resume from it "
+            "when present, e.g. after the run was interrupted");
+
+  program.add_argument("--checkpoint-interval")
+      .default_value(300)
+      .scan<'i', int>()
+      .help("Seconds between checkpoints. Defaults to 300");
+
   try {
     program.parse_args(argc, argv);
   } catch (const std::exception &err) {
@@ -39,26 +95,35 @@ int main(int argc, char **argv) {
 
   audio::init();
 
-  auto source = audio::openSource(ifile, err);
+  auto source = ifile == "-" ? audio::openStdinSource(err)
+                             : audio::openSource(ifile, err);
   if (err) {
     std::cerr << "Error opening audio file: " << err.message() << std::endl;
     return -1;
   }
 
-  auto demucs = demucs::openDemucs(model_file, err, device);
-  if (err) {
-    std::cerr << "Error opening model: " << err.message() << std::endl;
-    return -1;
+  auto opts = demucs::defaultDemucsOpts;
+  opts.silenceThreshold = program.get<float>("--silence-threshold");
+
+  if (program.get<bool>("--autotune")) {
+    opts = demucs::autotune(model_file, err, device, opts);
+    if (err) {
+      std::cerr << "Error autotuning model: " << err.message() << std::endl;
+      return -1;
+    }
+    demucs::saveTuning(model_file, device, opts, err);
+    if (err) {
+      std::cerr << "Error saving tuning profile: " << err.message()
+                << std::endl;
+      return -1;
+    }
+  } else if (demucs::loadTuning(model_file, device, opts)) {
+    std::cerr << "Using tuning from " << demucs::profilePath() << std::endl;
   }
 
-  audio::SinkOpts sinkOpts{
-      .sampleRate = 44100,
-      .sampleFormat = AV_SAMPLE_FMT_S16,
-      .bitRate = 16,
-  };
-  auto sink = audio::openSink(odir + "/out.wav", sinkOpts, err);
+  auto demucs = demucs::openDemucs(model_file, err, device, opts);
   if (err) {
-    std::cerr << "Error opening audio file: " << err.message() << std::endl;
+    std::cerr << "Error opening model: " << err.message() << std::endl;
     return -1;
   }
 
@@ -68,18 +133,130 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  audio::Resampler resamplerOut(demucs->codecParams, sink->aencContext, err);
-  if (err) {
-    std::cerr << "Error creating resampler: " << err.message() << std::endl;
-    return -1;
+  bool checkpoint = program.get<bool>("--checkpoint");
+  auto checkpointFile = odir + "/out.ckpt";
+  std::string checkpointKey;
+  demucs::Checkpoint resumed;
+  if (checkpoint) {
+    if (ifile == "-" || odir == "-" || program.get<bool>("--spool") ||
+        program.get<bool>("--peaks")) {
+      std::cerr << "Checkpoints need a file input and WAV file output only"
+                << std::endl;
+      return -1;
+    }
+    checkpointKey = demucs::checkpointKey(model_file, demucs->opts);
+    if (demucs::loadCheckpoint(checkpointFile, checkpointKey, resumed,
+                               *demucs, err)) {
+      demucs::seekCheckpoint(*source, resamplerIn, resumed, err);
+      std::cerr << "Resuming from " << checkpointFile << std::endl;
+    }
+    if (err) {
+      std::cerr << "Error resuming from checkpoint: " << err.message()
+                << std::endl;
+      return -1;
+    }
   }
 
-  auto chain = *source >> resamplerIn >> *demucs >> resamplerOut;
+  using audio::coro::stage;
+  auto frames = audio::coro::frames(*source, err) >> stage(resamplerIn, err);
+
+  std::optional<audio::Peaks> peaks;
+  if (program.get<bool>("--peaks")) {
+    if (odir == "-") {
+      std::cerr << "Peaks cannot be written when output is stdout"
+                << std::endl;
+      return -1;
+    }
+    peaks.emplace(peaksPaths(odir, demucs->sources));
+  }
+
+  if (program.get<bool>("--spool")) {
+    if (odir == "-") {
+      std::cerr << "Spool cannot be written when output is stdout" << std::endl;
+      return -1;
+    }
+    auto spool =
+        audio::openSpoolSink(odir + "/out.spool", demucs->sources, err);
+    if (err) {
+      std::cerr << "Error opening spool: " << err.message() << std::endl;
+      return -1;
+    }
+    auto stems = std::move(frames) >> stage<audio::Stems>(*demucs, err);
+    if (peaks)
+      stems = std::move(stems) >> stage<audio::Stems>(*peaks, err);
+    audio::coro::run(stems, *spool, err);
+  } else {
+    audio::SinkOpts sinkOpts{
+        .sampleRate = 44100,
+        .sampleFormat = AV_SAMPLE_FMT_S16,
+        .bitRate = 16,
+    };
+    std::unique_ptr<audio::FileSink> sink;
+    if (odir == "-") {
+      sink = audio::openStdoutSink("wav", sinkOpts, err);
+    } else if (checkpoint) {
+      sink = audio::openResumedSink(odir + "/out.wav", sinkOpts,
+                                    resumed.outputOffset, err);
+    } else {
+      sink = audio::openSink(odir + "/out.wav", sinkOpts, err);
+    }
+    if (err) {
+      std::cerr << "Error opening audio file: " << err.message() << std::endl;
+      return -1;
+    }
+
+    audio::Resampler resamplerOut(demucs->codecParams, sink->aencContext, err);
+    if (err) {
+      std::cerr << "Error creating resampler: " << err.message() << std::endl;
+      return -1;
+    }
 
-  audio::run(chain, *sink, err);
+    if (peaks) {
+      // every source passes the peaks stage, the first goes on to the output
+      frames = audio::coro::first(std::move(frames) >>
+                                  stage<audio::Stems>(*demucs, err) >>
+                                  stage<audio::Stems>(*peaks, err));
+    } else {
+      frames = std::move(frames) >> stage(*demucs, err);
+    }
+
+    frames = std::move(frames) >> stage(resamplerOut, err);
+
+    if (checkpoint) {
+      // one output frame per separated frame, so that the resampler is
+      // empty between frames and checkpoints can be taken
+      if (!resamplerOut.frameSize)
+        resamplerOut.frameSize = demucs->codecParams.frameSize();
+      demucs::CheckpointSink checkpointSink{
+          .sink = *sink,
+          .resampler = resamplerOut,
+          .demucs = *demucs,
+          .path = checkpointFile,
+          .key = checkpointKey,
+          .interval = std::chrono::seconds(
+              program.get<int>("--checkpoint-interval")),
+      };
+      audio::coro::run(frames, checkpointSink, err);
+    } else {
+      audio::coro::run(frames, *sink, err);
+    }
+  }
   if (err) {
     std::cerr << err.category().name() << ": " << err.message() << std::endl;
     std::cerr << "Error running graph: " << err.message() << std::endl;
     return -1;
   }
+
+  if (checkpoint) {
+    // left behind, it would resume into the finished output on the next run
+    std::filesystem::remove(checkpointFile, err);
+    if (err) {
+      std::cerr << "Error removing checkpoint " << checkpointFile << ": "
+                << err.message() << std::endl;
+      return -1;
+    }
+  }
+
+  std::cerr << "Skipped " << demucs->skippedSegmentCount << " of "
+            << demucs->segmentCount << " segments as silent" << std::endl;
 }
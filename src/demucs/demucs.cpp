@@ -20,7 +20,7 @@ std::map<std::string, Device> deviceMap = {
 std::unique_ptr<Demucs> openDemucs(const std::string &path,
                                    std::error_code &err, const Device device,
                                    const Opts &opts) {
-  if (path.ends_with(".pt")) {
+  if (path.ends_with(".pt") || path.ends_with(".bag")) {
 #ifdef DEMUCS_TORCH
     return std::make_unique<_torch::Demucs>(path, err, device, opts);
 #else
@@ -3,8 +3,12 @@
 #include "../audio/audio.hpp"
 #include <avcpp/codec.h>
 #include <avcpp/codeccontext.h>
+#include <iosfwd>
+#include <limits>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace demucs {
 
@@ -23,9 +27,27 @@ struct CodecParams {
 struct Opts {
   float_t transitionPower;
   float_t overlap;
+  // Segment length in seconds; 0 uses the length the model was trained on.
+  float_t segment;
+  // Segments quieter than this RMS level in dBFS are not run through the
+  // model and separate into silence; -inf disables skipping.
+  float_t silenceThreshold;
+  // Number of segments separated per forward call.
+  size_t batchSize;
+  // Threads of the backend; 0 keeps the backend's default.
+  int intraOpThreads;
+  int interOpThreads;
 };
 
-constexpr Opts defaultDemucsOpts = {.transitionPower = 1., .overlap = .25};
+constexpr Opts defaultDemucsOpts = {
+    .transitionPower = 1.,
+    .overlap = .25,
+    .segment = 0.,
+    .silenceThreshold = -std::numeric_limits<float_t>::infinity(),
+    .batchSize = 1,
+    .intraOpThreads = 0,
+    .interOpThreads = 0,
+};
 
 enum class Device {
   CPU,
@@ -38,10 +60,24 @@ extern std::map<std::string, Device> deviceMap;
 struct Demucs {
   demucs::CodecParams codecParams;
   demucs::Opts opts;
+  // Names of the separated sources, in the order the model outputs them.
+  std::vector<std::string> sources;
+  // Number of segments written, and how many of them were skipped as silent.
+  size_t segmentCount = 0;
+  size_t skippedSegmentCount = 0;
   virtual void write(av::AudioSamples &samples, audio::PipeState state,
                      std::error_code &err) = 0;
+  // Reads the frames of the first source.
   virtual audio::PipeState read(av::AudioSamples &samples,
                                 std::error_code &err) = 0;
+  // Reads the frames of every source, one entry per element of `sources`.
+  virtual audio::PipeState read(std::vector<av::AudioSamples> &samples,
+                                std::error_code &err) = 0;
+  // Saves everything the separation of the rest of the stream depends on, so
+  // that another instance with the same model and options can load it and
+  // carry on.
+  virtual void save(std::ostream &out, std::error_code &err) = 0;
+  virtual void load(std::istream &in, std::error_code &err) = 0;
   virtual ~Demucs() = default;
 };
 
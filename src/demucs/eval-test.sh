@@ -0,0 +1,68 @@
+#!/bin/sh
+# Runs demucs-eval over an overlap grid with the model exported by
+# make-fixture.py, whose stems are the mixture scaled by fixed gains, and
+# checks that every configuration gets a row separating the mixture near
+# perfectly. Needs python3 with torch.
+#
+# Usage: eval-test.sh <demucs-eval>
+
+set -eu
+
+demucs_eval=$1
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# keep a stored tuning from changing the options
+export STEMTOOLS_PROFILE="$tmp/autotune.tsv"
+
+python3 "$dir/make-fixture.py" "$tmp/fixture.pt"
+python3 - "$tmp" <<'EOF'
+import os
+import random
+import struct
+import sys
+import wave
+
+# twenty seconds of stereo noise, and the stems the fixture splits it into:
+# drums, bass, other and vocals at gains 1, 2, 3 and 4 tenths
+rate = 44100
+rng = random.Random(0)
+mixture = [rng.randint(-8000, 8000) for _ in range(2 * rate * 20)]
+stems = {"mixture": (mixture, 1)}
+for gain, source in enumerate(["drums", "bass", "other", "vocals"], 1):
+    stems[source] = (mixture, gain / 10)
+for name, (samples, gain) in stems.items():
+    with wave.open(os.path.join(sys.argv[1], name + ".wav"), "wb") as out:
+        out.setnchannels(2)
+        out.setsampwidth(2)
+        out.setframerate(rate)
+        scaled = [round(sample * gain) for sample in samples]
+        out.writeframes(struct.pack(f"<{len(scaled)}h", *scaled))
+EOF
+
+"$demucs_eval" "$tmp/fixture.pt" "$tmp/mixture.wav" "$tmp/drums.wav" \
+  "$tmp/bass.wav" "$tmp/other.wav" "$tmp/vocals.wav" --overlap 0.25 0.5 \
+  -o "$tmp/results.tsv"
+
+# a row per overlap, each with an SDR only quantization to 16 bits limits
+awk -F '\t' '
+NR == 1 {
+  for (i = 1; i <= NF; ++i) column[$i] = i
+  next
+}
+{
+  overlaps[$column["overlap"]] = 1
+  if ($column["sdr_mean"] < 40) {
+    print "Mean SDR of " $column["sdr_mean"] " dB at overlap " \
+      $column["overlap"] > "/dev/stderr"
+    failed = 1
+  }
+}
+END {
+  if (NR != 3 || !(0.25 in overlaps) || !(0.5 in overlaps)) {
+    print "Expected a row for each of overlap 0.25 and 0.5" > "/dev/stderr"
+    failed = 1
+  }
+  exit failed
+}' "$tmp/results.tsv" || { cat "$tmp/results.tsv" >&2; exit 1; }
@@ -0,0 +1,44 @@
+"""Exports a synthetic TorchScript model with the interface of a Demucs export.
+
+The model splits the mixture into sources by fixed per-source gains, so
+reference stems for it are the mixture scaled by the same gains. This lets
+demucs-test and demucs-eval run without the real weights.
+"""
+
+import argparse
+from typing import List
+
+import torch
+
+
+class Fixture(torch.nn.Module):
+    samplerate: int
+    segment: float
+    sources: List[str]
+
+    def __init__(self, sources: List[str], segment: float):
+        super().__init__()
+        self.samplerate = 44100
+        self.segment = segment
+        self.sources = sources
+        gains = torch.arange(1, len(sources) + 1, dtype=torch.float32)
+        self.register_buffer("gains", (gains / gains.sum()).view(1, -1, 1, 1))
+
+    def forward(self, mix: torch.Tensor) -> torch.Tensor:
+        return mix.unsqueeze(1) * self.gains
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("output", help="Path to write the .pt file to")
+    parser.add_argument("--segment", type=float, default=7.8)
+    parser.add_argument(
+        "--sources", nargs="+", default=["drums", "bass", "other", "vocals"]
+    )
+    args = parser.parse_args()
+
+    torch.jit.script(Fixture(args.sources, args.segment)).save(args.output)
+
+
+if __name__ == "__main__":
+    main()
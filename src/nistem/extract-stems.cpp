@@ -0,0 +1,79 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <argparse/argparse.hpp>
+
+#include "../audio/audio.hpp"
+
+int main(int argc, char **argv) {
+  argparse::ArgumentParser program("extract-stems");
+
+  program.add_argument("input").help(
+      "Path to the stem file. Every audio track is extracted");
+  program.add_argument("output").help(
+      "Path to the output directory. Track i is written to <i>.wav");
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (const std::exception &err) {
+    std::cerr << err.what() << std::endl;
+    std::cerr << program;
+    std::exit(1);
+  }
+
+  std::string ifile = program.get<std::string>("input");
+  std::string odir = program.get<std::string>("output");
+
+  std::error_code err;
+
+  audio::init();
+
+  auto source = audio::openMultiSource(ifile, err);
+  if (err) {
+    std::cerr << "Error opening audio file: " << err.message() << std::endl;
+    return -1;
+  }
+
+  audio::SinkOpts sinkOpts{
+      .sampleRate = 44100,
+      .sampleFormat = AV_SAMPLE_FMT_S16,
+      .bitRate = 16,
+  };
+
+  std::vector<audio::TrackSource> tracks;
+  std::vector<std::unique_ptr<audio::Resampler>> resamplers;
+  std::vector<std::unique_ptr<audio::FileSink>> sinks;
+  for (size_t i = 0; i < source->tracks.size(); ++i) {
+    auto path = odir + "/" + std::to_string(i) + ".wav";
+    sinks.push_back(audio::openSink(path, sinkOpts, err));
+    if (err) {
+      std::cerr << "Error opening audio file: " << err.message() << std::endl;
+      return -1;
+    }
+
+    resamplers.push_back(std::make_unique<audio::Resampler>(
+        source->tracks[i].adecContext, sinks.back()->aencContext, err));
+    if (err) {
+      std::cerr << "Error creating resampler: " << err.message() << std::endl;
+      return -1;
+    }
+
+    tracks.push_back({.source = *source, .track = i});
+  }
+
+  using Chain = decltype(tracks[0] >> *resamplers[0]);
+  std::vector<Chain> chains;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    chains.push_back(tracks[i] >> *resamplers[i]);
+  }
+
+  audio::runEach(chains, sinks, err);
+  if (err) {
+    std::cerr << err.category().name() << ": " << err.message() << std::endl;
+    std::cerr << "Error running graph: " << err.message() << std::endl;
+    return -1;
+  }
+}
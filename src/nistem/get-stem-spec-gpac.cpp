@@ -1,8 +1,10 @@
 #include <iostream>
+#include <string>
 #include <gpac/isomedia.h>
 #include <gpac/isomedia.h>
 
 #include "../common/util.hpp"
+#include "stem-index.hpp"
 
 using namespace util;
 
@@ -45,16 +47,11 @@ GF_Err get_isom_udta_str(GF_ISOFile *file, uint32_t dump_udta_type, uint32_t dum
 }
 
 
-int main(int argc, char** argv) {
-  GF_Err e;
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " <filename>" << std::endl;
-    return -1;
-  }
-  GF_ISOFile *file = gf_isom_open(argv[1], GF_ISOM_OPEN_READ, nullptr);
+// Reads the stem metadata stored in the moov.udta.stem atom.
+const char *readStemSpec(const std::string &path, std::string &spec) {
+  GF_ISOFile *file = gf_isom_open(path.c_str(), GF_ISOM_OPEN_READ, nullptr);
   if (!file) {
-    printf("Cannot open file %s\n", argv[1]);
-    return -1;
+    return "cannot open file";
   }
 
   defer close_file([&file] { gf_isom_close(file); });
@@ -63,18 +60,40 @@ int main(int argc, char** argv) {
   uint32_t dump_udta_type = GF_4CC(code[0], code[1], code[2], code[3]);
 
   char* out = nullptr;
-  uint32_t size;
-
-  e = get_isom_udta_str(file, dump_udta_type, 0, &out);
+  GF_Err e = get_isom_udta_str(file, dump_udta_type, 0, &out);
+  if (e == GF_NOT_FOUND) {
+    return nistem::notStemFile;
+  }
   if (e) {
-    printf("Error: %s\n", gf_error_to_string(e));
-    return -1;
+    return gf_error_to_string(e);
   }
 
   defer free_out([&out] { gf_free(out); });
 
-  std::cout << out << std::endl;
-  return 0;
+  spec = out;
+  return nullptr;
 }
 
+int main(int argc, char** argv) {
+  int status;
+  if (nistem::runIndexCommand(argc, argv, readStemSpec, status)) {
+    return status;
+  }
+
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <filename>" << std::endl;
+    std::cerr << "       " << argv[0]
+              << " --index <index> (--update <root> | --list | <filename>)"
+              << std::endl;
+    return -1;
+  }
 
+  std::string spec;
+  if (auto error = readStemSpec(argv[1], spec)) {
+    printf("Error: %s\n", error);
+    return -1;
+  }
+
+  std::cout << spec << std::endl;
+  return 0;
+}
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <vector>
 
+#include "stem-index.hpp"
+
 constexpr uint8_t atomPreambleSize = 8;
 constexpr uint8_t extendedSizeFieldSize = 8;
 
@@ -22,16 +25,11 @@ bool read(std::ifstream& stream, char* buffer, uint64_t size) {
   return stream.gcount() == size;
 }
 
-int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cerr << "usage: " << argv[0] << " <filename>" << std::endl;
-    return 1;
-  }
-
-  std::ifstream file(argv[1], std::ios::binary);
+// Reads the stem metadata stored in the moov.udta.stem atom.
+const char *readStemSpec(const std::string &path, std::string &spec) {
+  std::ifstream file(path, std::ios::binary);
   if (!file) {
-    std::cerr << "cannot open file " << argv[1] << std::endl;
-    return -1;
+    return "cannot open file";
   }
 
   char atomBytes[atomPreambleSize], extendedSizeBytes[extendedSizeFieldSize];
@@ -42,14 +40,12 @@ int main(int argc, char** argv) {
   while (true) {
     if (file.eof() || (openAtoms.size() && !openAtoms.back())) {
       // read file or consumed a child atom without advancing to next level
-      std::cerr << "not a stem file" << std::endl;
-      return 1;
+      return nistem::notStemFile;
     }
 
     // read atom preamble
     if (!read(file, atomBytes, atomPreambleSize)) {
-      std::cerr << "failed to read atom preamble" << std::endl;
-      return 1;
+      return "failed to read atom preamble";
     }
 
     bytesRead = atomPreambleSize;
@@ -57,8 +53,7 @@ int main(int argc, char** argv) {
 
     if (atomSize == 1) {
       if (!read(file, extendedSizeBytes, extendedSizeFieldSize)) {
-        std::cerr << "failed to read extended atom" << std::endl;
-        return 1;
+        return "failed to read extended atom";
       }
       bytesRead += extendedSizeFieldSize;
       atomSize = be64(extendedSizeBytes);
@@ -77,17 +72,36 @@ int main(int argc, char** argv) {
         openAtoms.size() == 1 && atomType == udtaAtom){
       openAtoms.push_back(atomSize);
     } else if (openAtoms.size() == 2 && atomType == stemAtom) {
-      std::string stemData(atomSize, 0);
-      if (!read(file, stemData.data(), atomSize)) {
-        std::cerr << "failed to read stem metadata" << std::endl;
-        return 1;
+      spec.assign(atomSize, 0);
+      if (!read(file, spec.data(), atomSize)) {
+        return "failed to read stem metadata";
       }
-      std::cout << stemData << std::endl;
-      break;
+      return nullptr;
     } else {
       file.seekg(atomSize, std::ios::cur);
     }
   }
-  return 0;
 }
 
+int main(int argc, char** argv) {
+  int status;
+  if (nistem::runIndexCommand(argc, argv, readStemSpec, status)) {
+    return status;
+  }
+
+  if (argc != 2) {
+    std::cerr << "usage: " << argv[0] << " <filename>" << std::endl;
+    std::cerr << "       " << argv[0]
+              << " --index <index> (--update <root> | --list | <filename>)"
+              << std::endl;
+    return 1;
+  }
+
+  std::string stemData;
+  if (auto error = readStemSpec(argv[1], stemData)) {
+    std::cerr << error << " " << argv[1] << std::endl;
+    return 1;
+  }
+  std::cout << stemData << std::endl;
+  return 0;
+}
@@ -0,0 +1,370 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stem-index.hpp"
+
+namespace fs = std::filesystem;
+
+namespace nistem {
+
+constexpr char indexMagic[] = {'S', 'T', 'I', 'X'};
+constexpr uint32_t indexVersion = 2;
+
+const char notStemFile[] = "not a stem file";
+
+struct EntryHeader {
+  uint32_t pathSize;
+  uint32_t specSize;
+  uint64_t size;
+  int64_t mtime;
+};
+
+static std::string normalize(const std::string &path) {
+  return fs::absolute(path).lexically_normal().string();
+}
+
+static int64_t mtime(fs::file_time_type time) {
+  return time.time_since_epoch().count();
+}
+
+static bool isUnder(std::string_view path, std::string_view root) {
+  if (!path.starts_with(root)) {
+    return false;
+  }
+  return root.ends_with(fs::path::preferred_separator) ||
+         path.size() == root.size() ||
+         path[root.size()] == fs::path::preferred_separator;
+}
+
+// Offset of the offset table, right after magic, version and count.
+constexpr size_t offsetsOffset =
+    sizeof(indexMagic) + sizeof(uint32_t) + sizeof(uint64_t);
+
+struct MappedIndex::EntryView {
+  EntryHeader header;
+  std::string_view path;
+  std::string_view spec;
+};
+
+MappedIndex::~MappedIndex() {
+  if (_data) {
+    munmap(const_cast<uint8_t *>(_data), _size);
+  }
+}
+
+bool MappedIndex::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)offsetsOffset) {
+    ::close(fd);
+    return false;
+  }
+  auto map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  _data = static_cast<const uint8_t *>(map);
+  _size = st.st_size;
+
+  uint32_t version;
+  std::memcpy(&version, _data + sizeof(indexMagic), sizeof(version));
+  std::memcpy(&_count, _data + sizeof(indexMagic) + sizeof(version),
+              sizeof(_count));
+  if (std::memcmp(_data, indexMagic, sizeof(indexMagic)) ||
+      version != indexVersion ||
+      _count > (_size - offsetsOffset) / sizeof(uint64_t)) {
+    _count = 0;
+    return false;
+  }
+  return true;
+}
+
+bool MappedIndex::view(uint64_t i, EntryView &entry) const {
+  uint64_t offset;
+  std::memcpy(&offset, _data + offsetsOffset + i * sizeof(offset),
+              sizeof(offset));
+  if (offset > _size || _size - offset < sizeof(EntryHeader)) {
+    return false;
+  }
+  std::memcpy(&entry.header, _data + offset, sizeof(EntryHeader));
+  offset += sizeof(EntryHeader);
+  if (_size - offset <
+      (uint64_t)entry.header.pathSize + entry.header.specSize) {
+    return false;
+  }
+  auto chars = reinterpret_cast<const char *>(_data + offset);
+  entry.path = {chars, entry.header.pathSize};
+  entry.spec = {chars + entry.header.pathSize, entry.header.specSize};
+  return true;
+}
+
+bool MappedIndex::entry(uint64_t i, IndexEntry &entry) const {
+  EntryView found;
+  if (i >= _count || !view(i, found)) {
+    return false;
+  }
+  entry = {
+      .path = std::string(found.path),
+      .size = found.header.size,
+      .mtime = found.header.mtime,
+      .spec = std::string(found.spec),
+  };
+  return true;
+}
+
+bool MappedIndex::find(std::string_view path, IndexEntry &entry) const {
+  uint64_t lo = 0, hi = _count;
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    EntryView found;
+    if (!view(mid, found)) {
+      return false;
+    }
+    if (found.path == path) {
+      return this->entry(mid, entry);
+    }
+    if (found.path < path) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return false;
+}
+
+static bool isFresh(const std::string &path, uint64_t size, int64_t time) {
+  std::error_code ec;
+  auto fileSize = fs::file_size(path, ec);
+  if (ec || fileSize != size) {
+    return false;
+  }
+  auto fileTime = fs::last_write_time(path, ec);
+  return !ec && mtime(fileTime) == time;
+}
+
+bool MappedIndex::findFresh(const std::string &path, IndexEntry &entry) const {
+  return find(normalize(path), entry) && isFresh(path, entry.size, entry.mtime);
+}
+
+bool Index::load(const std::string &path) {
+  entries.clear();
+  MappedIndex index;
+  if (!index.open(path)) {
+    return false;
+  }
+  entries.resize(index.size());
+  for (uint64_t i = 0; i < index.size(); ++i) {
+    if (!index.entry(i, entries[i])) {
+      entries.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Index::save(const std::string &path) const {
+  auto tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      return false;
+    }
+    uint64_t count = entries.size();
+    file.write(indexMagic, sizeof(indexMagic));
+    file.write(reinterpret_cast<const char *>(&indexVersion),
+               sizeof(indexVersion));
+    file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    uint64_t offset = offsetsOffset + count * sizeof(uint64_t);
+    for (const auto &entry : entries) {
+      file.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+      offset += sizeof(EntryHeader) + entry.path.size() + entry.spec.size();
+    }
+    for (const auto &entry : entries) {
+      EntryHeader header = {
+          .pathSize = static_cast<uint32_t>(entry.path.size()),
+          .specSize = static_cast<uint32_t>(entry.spec.size()),
+          .size = entry.size,
+          .mtime = entry.mtime,
+      };
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(entry.path.data(), entry.path.size());
+      file.write(entry.spec.data(), entry.spec.size());
+    }
+    if (!file.flush()) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmpPath, path, ec);
+  return !ec;
+}
+
+const IndexEntry *Index::find(std::string_view path) const {
+  auto it = std::lower_bound(
+      entries.begin(), entries.end(), path,
+      [](const IndexEntry &entry, std::string_view path) {
+        return entry.path < path;
+      });
+  if (it == entries.end() || it->path != path) {
+    return nullptr;
+  }
+  return &*it;
+}
+
+const IndexEntry *Index::findFresh(const std::string &path) const {
+  auto entry = find(normalize(path));
+  if (!entry || !isFresh(path, entry->size, entry->mtime)) {
+    return nullptr;
+  }
+  return entry;
+}
+
+size_t Index::update(const std::string &root, const SpecReader &reader) {
+  auto base = normalize(root);
+  std::vector<IndexEntry> updated;
+  size_t reads = 0;
+
+  // entries outside of the root are kept as they are
+  for (const auto &entry : entries) {
+    if (!isUnder(entry.path, base)) {
+      updated.push_back(entry);
+    }
+  }
+
+  std::error_code ec;
+  fs::recursive_directory_iterator it(
+      base, fs::directory_options::skip_permission_denied, ec);
+  for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    std::error_code statErr;
+    if (!it->is_regular_file(statErr) || it->path().extension() != ".mp4") {
+      continue;
+    }
+    IndexEntry entry = {
+        .path = it->path().lexically_normal().string(),
+        .size = it->file_size(statErr),
+        .mtime = mtime(it->last_write_time(statErr)),
+        .spec = {},
+    };
+    if (statErr) {
+      continue;
+    }
+
+    auto old = find(entry.path);
+    if (old && old->size == entry.size && old->mtime == entry.mtime) {
+      entry.spec = old->spec;
+    } else {
+      ++reads;
+      auto error = reader(entry.path, entry.spec);
+      if (error && std::strcmp(error, notStemFile)) {
+        // e.g. a file that cannot be opened right now; an outdated entry
+        // is kept, as it does not pass as fresh, and the file is read
+        // again by the next update
+        std::cerr << entry.path << ": " << error << std::endl;
+        if (old) {
+          updated.push_back(*old);
+        }
+        continue;
+      }
+      // files that are not stem files are indexed with an empty spec, so
+      // they are not read again either
+      if (error) {
+        entry.spec.clear();
+      }
+    }
+    updated.push_back(std::move(entry));
+  }
+  if (ec) {
+    std::cerr << "failed to walk " << base << ": " << ec.message()
+              << std::endl;
+  }
+
+  std::sort(updated.begin(), updated.end(),
+            [](const IndexEntry &a, const IndexEntry &b) {
+              return a.path < b.path;
+            });
+  entries = std::move(updated);
+  return reads;
+}
+
+bool runIndexCommand(int argc, char **argv, const SpecReader &reader,
+                     int &status) {
+  if (argc < 4 || std::strcmp(argv[1], "--index")) {
+    return false;
+  }
+
+  std::string indexPath = argv[2];
+
+  if (argc == 5 && !std::strcmp(argv[3], "--update")) {
+    Index index;
+    if (!index.load(indexPath)) {
+      // e.g. written by an older version; every file is read again
+      std::cerr << "cannot read index " << indexPath << ", rebuilding"
+                << std::endl;
+    }
+    auto reads = index.update(argv[4], reader);
+    if (!index.save(indexPath)) {
+      std::cerr << "cannot write index " << indexPath << std::endl;
+      status = 1;
+      return true;
+    }
+    std::cerr << "indexed " << index.entries.size() << " files, read "
+              << reads << std::endl;
+    status = 0;
+    return true;
+  }
+
+  MappedIndex index;
+  if (!index.open(indexPath)) {
+    std::cerr << "cannot read index " << indexPath << std::endl;
+    status = 1;
+    return true;
+  }
+
+  if (argc == 4 && !std::strcmp(argv[3], "--list")) {
+    IndexEntry entry;
+    for (uint64_t i = 0; i < index.size(); ++i) {
+      if (index.entry(i, entry) && !entry.spec.empty()) {
+        std::cout << entry.path << '\t' << entry.spec << '\n';
+      }
+    }
+    status = 0;
+  } else if (argc == 4) {
+    std::string spec;
+    const char *error = nullptr;
+    IndexEntry entry;
+    if (index.findFresh(argv[3], entry)) {
+      spec = std::move(entry.spec);
+      error = spec.empty() ? notStemFile : nullptr;
+    } else {
+      error = reader(argv[3], spec);
+    }
+    if (error) {
+      std::cerr << error << std::endl;
+      status = 1;
+    } else {
+      std::cout << spec << std::endl;
+      status = 0;
+    }
+  } else {
+    std::cerr << "usage: " << argv[0]
+              << " --index <index> (--update <root> | --list | <filename>)"
+              << std::endl;
+    status = 1;
+  }
+  return true;
+}
+
+} // namespace nistem
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nistem {
+
+// Reads the stem metadata of a file into `spec`. Returns an error message, or
+// nullptr on success.
+using SpecReader =
+    std::function<const char *(const std::string &path, std::string &spec)>;
+
+// Error a SpecReader returns for a file it read that holds no stem metadata.
+// Only this result is indexed as an empty spec; files failing with any other
+// error, e.g. one that cannot be opened, are read again by the next update.
+extern const char notStemFile[];
+
+struct IndexEntry {
+  std::string path;
+  uint64_t size;
+  int64_t mtime;
+  // Stem metadata JSON; empty if the file is not a stem file.
+  std::string spec;
+};
+
+// Stem metadata of a library, keyed by path and validated by file size and
+// modification time.
+//
+// File layout, native byte order:
+//   char[4] magic "STIX", u32 version, u64 count,
+//   u64 offsets[count], the file offset of each entry in path order,
+//   then the entries: u32 pathSize, u32 specSize, u64 size, i64 mtime, path,
+//   spec.
+struct Index {
+  // Sorted by path.
+  std::vector<IndexEntry> entries;
+
+  // Loads the index. A missing file loads as an empty index.
+  bool load(const std::string &path);
+  // Atomically replaces the index file.
+  bool save(const std::string &path) const;
+  const IndexEntry *find(std::string_view path) const;
+  // Returns the entry of a file if it is unchanged since it was indexed.
+  const IndexEntry *findFresh(const std::string &path) const;
+  // Indexes the .mp4 files under `root`, re-reading only files that changed
+  // and dropping files that no longer exist. Returns the number of files read.
+  size_t update(const std::string &root, const SpecReader &reader);
+};
+
+// Read-only view of an index file mapped into memory, for looking up single
+// files without loading the whole index. Lookups binary search the offset
+// table and only copy out the entry they find.
+struct MappedIndex {
+  MappedIndex() = default;
+  MappedIndex(const MappedIndex &) = delete;
+  MappedIndex &operator=(const MappedIndex &) = delete;
+  ~MappedIndex();
+
+  // Maps the index. A missing file opens as an empty index.
+  bool open(const std::string &path);
+  uint64_t size() const { return _count; }
+  // Copies out the `i`-th entry in path order. Returns false if it is
+  // malformed.
+  bool entry(uint64_t i, IndexEntry &entry) const;
+  bool find(std::string_view path, IndexEntry &entry) const;
+  // Finds the entry of a file if it is unchanged since it was indexed.
+  bool findFresh(const std::string &path, IndexEntry &entry) const;
+
+private:
+  struct EntryView;
+  bool view(uint64_t i, EntryView &entry) const;
+
+  const uint8_t *_data = nullptr;
+  size_t _size = 0;
+  uint64_t _count = 0;
+};
+
+// Handles the index command lines shared by the get-stem-spec tools:
+//   <program> --index <index> --update <root>
+//   <program> --index <index> --list
+//   <program> --index <index> <filename>
+// Returns false if the command line does not ask for the index.
+bool runIndexCommand(int argc, char **argv, const SpecReader &reader,
+                     int &status);
+
+} // namespace nistem